@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aquaria.h"
+#include "aq_binlog.h"
+#include "aq_proto.h"
+
+/* File layout, all integers little-endian:
+ *
+ *	u32 magic, u32 length of the wire table
+ *	u16 wires, then for each: u8 name length, name
+ *
+ * followed by blocks, each holding a run of one wire's
+ * samples:
+ *
+ *	u32 length (of what follows)
+ *	u16 wire, u16 samples
+ *	u64 first time, u64 last time (us since the epoch)
+ *	u64 first value, u64 min, u64 max, u64 sum
+ *	for each later sample:
+ *	    varint (zigzag change in time delta) << 1 | value changed
+ *	    varint zigzag value delta, if the value changed
+ *
+ * Samples are taken at a steady rate, and most readings repeat,
+ * so most samples take one byte. A wire's blocks are in time
+ * order. The min, max and sum let an aggregate skip the blocks
+ * wholly inside its range.
+ */
+#define AQ_BINLOG_MAGIC		0x314c5141	/* "AQL1" */
+#define AQ_BINLOG_HEADER	8
+#define AQ_BINLOG_BLOCK_HEADER	56
+#define AQ_BINLOG_NAME_MAX	255
+
+/* Size of a block, and how long one is held open */
+#define AQ_BINLOG_BLOCK		4096
+#define AQ_BINLOG_SPAN		(10 * 60 * 1000000ULL)
+
+/* Longest encoding of one sample */
+#define AQ_BINLOG_SAMPLE_MAX	20
+
+struct aq_binlog_block {
+	uint64_t time;
+	uint64_t last;
+	uint64_t value;
+	uint64_t prev;
+	uint64_t delta;		/* Between the last two times */
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	unsigned int count;
+	size_t len;		/* Of buf, including the header */
+	uint8_t buf[AQ_BINLOG_BLOCK];
+};
+
+struct aq_binlog {
+	int wires;
+	char **name;		/* NULL if not logged */
+
+	/* Writer only */
+	FILE *file;
+	struct aq_binlog_block **block;	/* Open block of each wire */
+	uint64_t now;		/* Latest time appended */
+	int dirty;
+
+	/* Reader only */
+	const uint8_t *map;
+	size_t size;
+	struct aq_binlog_index {
+		size_t *off;
+		int count;
+		int size;
+	} *index;
+};
+
+static size_t aq_binlog_put_varint(uint8_t *p, uint64_t v)
+{
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+
+	return n;
+}
+
+/* Returns the bytes taken, or 0 if it runs past 'end' */
+static size_t aq_binlog_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	size_t n;
+	int shift;
+
+	*v = 0;
+	for (n = 0, shift = 0; p + n < end && shift < 64; n++, shift += 7) {
+		*v |= (uint64_t)(p[n] & 0x7f) << shift;
+		if ((p[n] & 0x80) == 0)
+			return n + 1;
+	}
+
+	return 0;
+}
+
+static uint64_t aq_binlog_zigzag(uint64_t delta)
+{
+	return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static uint64_t aq_binlog_unzigzag(uint64_t v)
+{
+	return (v >> 1) ^ -(v & 1);
+}
+
+struct aq_binlog *aq_binlog_create(const char *path)
+{
+	struct aq_binlog *bl;
+	FILE *file;
+
+	file = fopen(path, "we");
+	if (file == NULL)
+		return NULL;
+
+	bl = calloc(1, sizeof(*bl));
+	if (bl == NULL) {
+		fclose(file);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	bl->file = file;
+
+	return bl;
+}
+
+int aq_binlog_wire(struct aq_binlog *bl, int wire, const char *name)
+{
+	char **names;
+
+	if (wire != bl->wires + 1 || bl->block != NULL)
+		return -EINVAL;
+
+	names = realloc(bl->name, wire * sizeof(*names));
+	if (names == NULL)
+		return -ENOMEM;
+	bl->name = names;
+
+	/* Cut short, it couldn't be found again, so keep the
+	 * wire's number but none of its samples.
+	 */
+	if (strlen(name) > AQ_BINLOG_NAME_MAX) {
+		bl->name[bl->wires++] = NULL;
+		return -ENAMETOOLONG;
+	}
+
+	bl->name[bl->wires] = strdup(name);
+	if (bl->name[bl->wires] == NULL)
+		return -ENOMEM;
+	bl->wires++;
+
+	return 0;
+}
+
+/* Write the wire table. Samples can be appended from here on.
+ */
+int aq_binlog_begin(struct aq_binlog *bl)
+{
+	uint8_t hdr[AQ_BINLOG_HEADER + 2];
+	size_t len = 2;
+	uint8_t nlen;
+	int i;
+
+	bl->block = calloc(bl->wires ? bl->wires : 1, sizeof(*bl->block));
+	if (bl->block == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < bl->wires; i++)
+		len += 1 + (bl->name[i] ? strlen(bl->name[i]) : 0);
+
+	aq_put_le32(&hdr[0], AQ_BINLOG_MAGIC);
+	aq_put_le32(&hdr[4], len);
+	aq_put_le16(&hdr[8], bl->wires);
+	fwrite(hdr, sizeof(hdr), 1, bl->file);
+	for (i = 0; i < bl->wires; i++) {
+		nlen = bl->name[i] ? strlen(bl->name[i]) : 0;
+		fwrite(&nlen, 1, 1, bl->file);
+		fwrite(bl->name[i], nlen, 1, bl->file);
+	}
+
+	return (fflush(bl->file) == 0) ? 0 : -errno;
+}
+
+/* Append a wire's open block to the file
+ */
+static void aq_binlog_emit(struct aq_binlog *bl, int wire)
+{
+	struct aq_binlog_block *b = bl->block[wire - 1];
+	uint8_t *p = b->buf;
+
+	if (b->count == 0)
+		return;
+
+	aq_put_le32(&p[0], b->len - 4);
+	aq_put_le16(&p[4], wire);
+	aq_put_le16(&p[6], b->count);
+	aq_put_le64(&p[8], b->time);
+	aq_put_le64(&p[16], b->last);
+	aq_put_le64(&p[24], b->value);
+	aq_put_le64(&p[32], b->min);
+	aq_put_le64(&p[40], b->max);
+	aq_put_le64(&p[48], b->sum);
+	fwrite(b->buf, b->len, 1, bl->file);
+
+	b->count = 0;
+	bl->dirty = 1;
+}
+
+void aq_binlog_append(struct aq_binlog *bl, int wire, uint64_t time, uint64_t value)
+{
+	struct aq_binlog_block *b;
+
+	if (wire < 1 || wire > bl->wires || bl->block == NULL || bl->name[wire - 1] == NULL)
+		return;
+
+	b = bl->block[wire - 1];
+	if (b == NULL) {
+		b = malloc(sizeof(*b));
+		if (b == NULL)
+			return;
+		b->count = 0;
+		bl->block[wire - 1] = b;
+	}
+
+	if (b->count > 0 && (b->len + AQ_BINLOG_SAMPLE_MAX > sizeof(b->buf) ||
+	                     b->count == UINT16_MAX || time - b->time >= AQ_BINLOG_SPAN))
+		aq_binlog_emit(bl, wire);
+
+	if (b->count == 0) {
+		b->time = time;
+		b->value = value;
+		b->min = value;
+		b->max = value;
+		b->sum = 0;
+		b->delta = 0;
+		b->len = AQ_BINLOG_BLOCK_HEADER;
+	} else {
+		b->len += aq_binlog_put_varint(&b->buf[b->len],
+		                               aq_binlog_zigzag(time - b->last - b->delta) << 1 |
+		                               (value != b->prev));
+		if (value != b->prev)
+			b->len += aq_binlog_put_varint(&b->buf[b->len], aq_binlog_zigzag(value - b->prev));
+		b->delta = time - b->last;
+	}
+
+	if (value < b->min)
+		b->min = value;
+	if (value > b->max)
+		b->max = value;
+	b->sum += value;
+	b->last = time;
+	b->prev = value;
+	b->count++;
+
+	if (time > bl->now)
+		bl->now = time;
+}
+
+/* Write out the blocks that have been open too long, so
+ * that a quiet wire's samples still reach the disk.
+ */
+int aq_binlog_flush(struct aq_binlog *bl)
+{
+	struct aq_binlog_block *b;
+	int i;
+
+	for (i = 0; bl->block != NULL && i < bl->wires; i++) {
+		b = bl->block[i];
+		if (b != NULL && b->count > 0 && bl->now - b->time >= AQ_BINLOG_SPAN)
+			aq_binlog_emit(bl, i + 1);
+	}
+
+	if (!bl->dirty)
+		return 0;
+
+	bl->dirty = 0;
+	return (fflush(bl->file) == 0) ? 0 : -errno;
+}
+
+void aq_binlog_destroy(struct aq_binlog *bl)
+{
+	int i;
+
+	for (i = 0; i < bl->wires; i++) {
+		if (bl->block != NULL && bl->block[i] != NULL) {
+			aq_binlog_emit(bl, i + 1);
+			free(bl->block[i]);
+		}
+		free(bl->name[i]);
+	}
+
+	fclose(bl->file);
+	free(bl->block);
+	free(bl->name);
+	free(bl);
+}
+
+/* Reader side
+ */
+static int aq_binlog_index(struct aq_binlog *bl, int wire, size_t off)
+{
+	struct aq_binlog_index *ix = &bl->index[wire - 1];
+	size_t *offs;
+	int size;
+
+	if (ix->count == ix->size) {
+		size = ix->size ? ix->size * 2 : 16;
+		offs = realloc(ix->off, size * sizeof(*offs));
+		if (offs == NULL)
+			return -ENOMEM;
+		ix->off = offs;
+		ix->size = size;
+	}
+
+	ix->off[ix->count++] = off;
+
+	return 0;
+}
+
+struct aq_binlog *aq_binlog_open(const char *path)
+{
+	struct aq_binlog *bl;
+	struct stat st;
+	const uint8_t *p;
+	size_t off, len;
+	uint32_t blen;
+	void *map;
+	int fd, i, wire, err = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < AQ_BINLOG_HEADER + 2) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	bl = calloc(1, sizeof(*bl));
+	if (bl == NULL) {
+		munmap(map, st.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	bl->map = map;
+	bl->size = st.st_size;
+
+	p = bl->map;
+	len = aq_get_le32(&p[4]);
+	if (aq_get_le32(&p[0]) != AQ_BINLOG_MAGIC || AQ_BINLOG_HEADER + len > bl->size) {
+		aq_binlog_close(bl);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bl->wires = aq_get_le16(&p[8]);
+	bl->name = calloc(bl->wires ? bl->wires : 1, sizeof(*bl->name));
+	bl->index = calloc(bl->wires ? bl->wires : 1, sizeof(*bl->index));
+	if (bl->name == NULL || bl->index == NULL)
+		err = -ENOMEM;
+	for (i = 0, off = AQ_BINLOG_HEADER + 2; err == 0 && i < bl->wires; i++) {
+		if (off >= AQ_BINLOG_HEADER + len || off + 1 + p[off] > AQ_BINLOG_HEADER + len) {
+			err = -EINVAL;
+			break;
+		}
+		bl->name[i] = strndup((const char *)&p[off + 1], p[off]);
+		if (bl->name[i] == NULL)
+			err = -ENOMEM;
+		off += 1 + p[off];
+	}
+
+	/* Index the blocks of each wire. A block cut short by
+	 * a writer that is still at it, or died, ends the log.
+	 */
+	for (off = AQ_BINLOG_HEADER + len; err == 0 && off + AQ_BINLOG_BLOCK_HEADER <= bl->size;
+	     off += 4 + blen) {
+		blen = aq_get_le32(&p[off]);
+		if (blen < AQ_BINLOG_BLOCK_HEADER - 4 || off + 4 + blen > bl->size)
+			break;
+
+		wire = aq_get_le16(&p[off + 4]);
+		if (wire >= 1 && wire <= bl->wires)
+			err = aq_binlog_index(bl, wire, off);
+	}
+
+	if (err < 0) {
+		aq_binlog_close(bl);
+		errno = -err;
+		return NULL;
+	}
+
+	return bl;
+}
+
+void aq_binlog_close(struct aq_binlog *bl)
+{
+	int i;
+
+	for (i = 0; i < bl->wires; i++) {
+		if (bl->name != NULL)
+			free(bl->name[i]);
+		if (bl->index != NULL)
+			free(bl->index[i].off);
+	}
+	free(bl->name);
+	free(bl->index);
+	munmap((void *)bl->map, bl->size);
+	free(bl);
+}
+
+int aq_binlog_wires(struct aq_binlog *bl)
+{
+	return bl->wires;
+}
+
+const char *aq_binlog_name(struct aq_binlog *bl, int id)
+{
+	if (id < 0 || id >= bl->wires)
+		return NULL;
+
+	return bl->name[id];
+}
+
+int aq_binlog_find(struct aq_binlog *bl, const char *name)
+{
+	int i;
+
+	for (i = 0; i < bl->wires; i++) {
+		if (bl->name[i] != NULL && strcmp(bl->name[i], name) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/* Decode the samples of a block that fall in [from, to]
+ */
+static int aq_binlog_decode(struct aq_binlog *bl, size_t off, uint64_t from, uint64_t to,
+                            int (*sample)(void *priv, uint64_t time, uint64_t value),
+                            void *priv)
+{
+	const uint8_t *p = &bl->map[off];
+	const uint8_t *end = p + 4 + aq_get_le32(p);
+	uint64_t time, value, delta = 0, v;
+	unsigned int i, count;
+	size_t n;
+	int err;
+
+	count = aq_get_le16(&p[6]);
+	time = aq_get_le64(&p[8]);
+	value = aq_get_le64(&p[24]);
+	p += AQ_BINLOG_BLOCK_HEADER;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			n = aq_binlog_get_varint(p, end, &v);
+			if (n == 0)
+				return -EINVAL;
+			delta += aq_binlog_unzigzag(v >> 1);
+			time += delta;
+			p += n;
+
+			if (v & 1) {
+				n = aq_binlog_get_varint(p, end, &v);
+				if (n == 0)
+					return -EINVAL;
+				value += aq_binlog_unzigzag(v);
+				p += n;
+			}
+		}
+
+		/* The wall clock can step back */
+		if (time < from || time > to)
+			continue;
+
+		err = sample(priv, time, value);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+int aq_binlog_read(struct aq_binlog *bl, int id, uint64_t from, uint64_t to,
+                   int (*sample)(void *priv, uint64_t time, uint64_t value),
+                   void *priv)
+{
+	struct aq_binlog_index *ix;
+	const uint8_t *p;
+	int i, err;
+
+	if (id < 0 || id >= bl->wires)
+		return -EINVAL;
+
+	ix = &bl->index[id];
+	for (i = 0; i < ix->count; i++) {
+		p = &bl->map[ix->off[i]];
+		if (aq_get_le64(&p[16]) < from || aq_get_le64(&p[8]) > to)
+			continue;
+
+		err = aq_binlog_decode(bl, ix->off[i], from, to, sample, priv);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+static int aq_binlog_add(void *priv, uint64_t time, uint64_t value)
+{
+	struct aq_binlog_stats *st = priv;
+
+	if (st->count == 0 || value < st->min)
+		st->min = value;
+	if (st->count == 0 || value > st->max)
+		st->max = value;
+	st->sum += value;
+	st->count++;
+
+	return 0;
+}
+
+int aq_binlog_aggregate(struct aq_binlog *bl, int id, uint64_t from, uint64_t to,
+                        struct aq_binlog_stats *st)
+{
+	struct aq_binlog_index *ix;
+	struct aq_binlog_stats blk;
+	const uint8_t *p;
+	uint64_t first, last;
+	int i, err;
+
+	memset(st, 0, sizeof(*st));
+	if (id < 0 || id >= bl->wires)
+		return -EINVAL;
+
+	ix = &bl->index[id];
+	for (i = 0; i < ix->count; i++) {
+		p = &bl->map[ix->off[i]];
+		first = aq_get_le64(&p[8]);
+		last = aq_get_le64(&p[16]);
+		if (last < from || first > to)
+			continue;
+
+		if (first < from || last > to) {
+			err = aq_binlog_decode(bl, ix->off[i], from, to, aq_binlog_add, st);
+			if (err != 0)
+				return err;
+			continue;
+		}
+
+		/* Wholly inside; no need to decode */
+		blk.count = aq_get_le16(&p[6]);
+		blk.min = aq_get_le64(&p[32]);
+		blk.max = aq_get_le64(&p[40]);
+		blk.sum = aq_get_le64(&p[48]);
+		if (st->count == 0 || blk.min < st->min)
+			st->min = blk.min;
+		if (st->count == 0 || blk.max > st->max)
+			st->max = blk.max;
+		st->sum += blk.sum;
+		st->count += blk.count;
+	}
+
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef AQ_BINLOG_H
+#define AQ_BINLOG_H
+
+#include <stdint.h>
+
+#include "aquaria.h"
+
+/* Writer side of the binary log. The reader side is in
+ * aquaria.h.
+ *
+ * Wires are numbered from 1, in the order they are added,
+ * and must all be added before aq_binlog_begin(). A wire
+ * whose name is over 255 bytes keeps its number, but none of
+ * its samples are logged: aq_binlog_wire() returns -ENAMETOOLONG.
+ */
+struct aq_binlog *aq_binlog_create(const char *path);
+int aq_binlog_wire(struct aq_binlog *bl, int wire, const char *name);
+int aq_binlog_begin(struct aq_binlog *bl);
+void aq_binlog_append(struct aq_binlog *bl, int wire, uint64_t time, uint64_t value);
+int aq_binlog_flush(struct aq_binlog *bl);
+void aq_binlog_destroy(struct aq_binlog *bl);
+
+#endif /* AQ_BINLOG_H */
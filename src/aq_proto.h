@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef AQ_PROTO_H
+#define AQ_PROTO_H
+
+#include <stdint.h>
+
+/* Binary protocol, see doc/Protocol.txt
+ *
+ * A client that starts with AQ_PROTO_MAGIC gets the binary
+ * protocol instead of JSON. The daemon echoes the magic, and
+ * then both sides send frames of:
+ *
+ *	u32 length	(of what follows)
+ *	u8  type
+ *	    payload
+ *
+ * All integers are little-endian.
+ */
+#define AQ_PROTO_MAGIC		"AQB1"
+#define AQ_PROTO_MAGIC_LEN	4
+
+#define AQ_FRAME_HEADER		5
+#define AQ_FRAME_MAX		(64 * 1024)
+
+enum aq_frame_type {
+	/* Client to daemon */
+	AQ_FRAME_GET	= 0x01,	/* u8 mask */
+	AQ_FRAME_SET	= 0x02,	/* u16 device, u8 active, u32 expire */
+	AQ_FRAME_BATCH	= 0x03,	/* SET payloads, back to back */
+	AQ_FRAME_SUBSCRIBE = 0x04,	/* No payload */
+
+	/* Daemon to client */
+	AQ_FRAME_SCHEMA	= 0x81,	/* Sensor and device names, by id */
+	AQ_FRAME_STATE	= 0x82,	/* u8 mask, then sensors, then devices */
+	AQ_FRAME_ERROR	= 0x83,	/* Request refused */
+	AQ_FRAME_UPDATE	= 0x84,	/* As STATE, pushed to a subscriber */
+};
+
+/* Which parts of the state a GET or STATE covers */
+#define AQ_FRAME_SENSORS	0x01
+#define AQ_FRAME_DEVICES	0x02
+
+#define AQ_FRAME_NAME_MAX	255	/* Longest name in a SCHEMA */
+#define AQ_FRAME_SET_LEN	7	/* SET payload */
+#define AQ_FRAME_SENSOR_LEN	16	/* u64 reading, u32 late, u32 missed */
+#define AQ_FRAME_DEVICE_LEN	6	/* u8 state, u8 override, u32 expire */
+
+#define AQ_FRAME_STATE_NONE	0xff	/* AQ_STATE_UNCHANGED */
+
+static inline void aq_put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static inline void aq_put_le32(uint8_t *p, uint32_t v)
+{
+	aq_put_le16(&p[0], v);
+	aq_put_le16(&p[2], v >> 16);
+}
+
+static inline void aq_put_le64(uint8_t *p, uint64_t v)
+{
+	aq_put_le32(&p[0], v);
+	aq_put_le32(&p[4], v >> 32);
+}
+
+static inline uint16_t aq_get_le16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t aq_get_le32(const uint8_t *p)
+{
+	return aq_get_le16(&p[0]) | ((uint32_t)aq_get_le16(&p[2]) << 16);
+}
+
+static inline uint64_t aq_get_le64(const uint8_t *p)
+{
+	return aq_get_le32(&p[0]) | ((uint64_t)aq_get_le32(&p[4]) << 32);
+}
+
+#endif /* AQ_PROTO_H */
@@ -0,0 +1,311 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aquaria.h"
+#include "aq_rollup.h"
+
+/* File layout: the header, then a record for each sensor that
+ * has ever been rolled up, found by name. A record is the name,
+ * then a ring of buckets for each level.
+ *
+ * A bucket lives at (start / secs) % slots of its ring, and
+ * holds the start of the interval it is for; one with any other
+ * start is stale, and is reset when the ring comes round to it.
+ * So an update is constant time, and nothing is ever moved.
+ */
+#define AQ_ROLLUP_MAGIC	0x41515231	/* "AQR1" */
+
+#define AQ_ROLLUP_LEVELS	3
+#define AQ_ROLLUP_NAME		64	/* With the NUL */
+
+static const struct aq_rollup_level {
+	uint32_t secs;
+	uint32_t slots;
+} aq_rollup_level[AQ_ROLLUP_LEVELS] = {
+	{ 1, 3600 },		/* An hour of seconds */
+	{ 60, 7 * 1440 },	/* A week of minutes */
+	{ 3600, 366 * 24 },	/* A year of hours */
+};
+
+#define AQ_ROLLUP_BUCKETS	(3600 + 7 * 1440 + 366 * 24)
+
+struct aq_rollup_header {
+	uint32_t magic;
+	uint32_t sensors;
+	struct aq_rollup_level level[AQ_ROLLUP_LEVELS];
+};
+
+struct aq_rollup_bucket {
+	uint32_t time;		/* Start, 0 if never used */
+	uint32_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+struct aq_rollup_sensor {
+	char name[AQ_ROLLUP_NAME];
+	struct aq_rollup_bucket bucket[AQ_ROLLUP_BUCKETS];
+};
+
+struct aq_rollup {
+	struct aq_rollup_header *hdr;
+	size_t size;
+	int *record;		/* Of each sensor, by id */
+	int sensors;
+};
+
+static struct aq_rollup_sensor *aq_rollup_record(struct aq_rollup *ro, int i)
+{
+	return (struct aq_rollup_sensor *)(ro->hdr + 1) + i;
+}
+
+/* Map 'records' sensor records of the file
+ */
+static int aq_rollup_map(struct aq_rollup *ro, int fd, int records)
+{
+	size_t size = sizeof(*ro->hdr) + records * sizeof(struct aq_rollup_sensor);
+	void *map;
+
+	if (ro->hdr != NULL && ro->size == size)
+		return 0;
+
+	if (ftruncate(fd, size) < 0)
+		return -errno;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	if (ro->hdr != NULL)
+		munmap(ro->hdr, ro->size);
+	ro->hdr = map;
+	ro->size = size;
+
+	return 0;
+}
+
+struct aq_rollup *aq_rollup_create(struct aquaria *aq, const char *path)
+{
+	struct aq_rollup *ro;
+	struct aq_rollup_sensor *rec;
+	struct aq_sensor *sen;
+	struct stat st;
+	int fd, i, j, records, err;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	ro = calloc(1, sizeof(*ro));
+	if (ro == NULL) {
+		close(fd);
+		return NULL;
+	}
+	for (sen = aq_sensors(aq); sen != NULL; sen = aq_sensor_next(sen))
+		ro->sensors++;
+	ro->record = calloc(ro->sensors ? ro->sensors : 1, sizeof(*ro->record));
+	if (ro->record == NULL) {
+		close(fd);
+		free(ro);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	err = (fstat(fd, &st) < 0) ? -errno : 0;
+	if (err == 0 && st.st_size == 0) {
+		err = aq_rollup_map(ro, fd, 0);
+		if (err == 0) {
+			ro->hdr->magic = AQ_ROLLUP_MAGIC;
+			memcpy(ro->hdr->level, aq_rollup_level, sizeof(aq_rollup_level));
+		}
+	} else if (err == 0) {
+		/* Don't write over something that isn't ours */
+		records = (st.st_size - sizeof(*ro->hdr)) / sizeof(struct aq_rollup_sensor);
+		if (st.st_size < sizeof(*ro->hdr) ||
+		    st.st_size != sizeof(*ro->hdr) + records * sizeof(struct aq_rollup_sensor))
+			err = -EINVAL;
+		else
+			err = aq_rollup_map(ro, fd, records);
+		if (err == 0 && (ro->hdr->magic != AQ_ROLLUP_MAGIC ||
+		                 ro->hdr->sensors != records ||
+		                 memcmp(ro->hdr->level, aq_rollup_level, sizeof(aq_rollup_level)) != 0))
+			err = -EINVAL;
+	}
+
+	/* Pick up where the last run left off, and add a
+	 * record for each sensor that is new. Names are kept
+	 * whole, so a sensor whose name doesn't fit has none.
+	 */
+	for (i = 0, sen = aq_sensors(aq); err == 0 && sen != NULL; sen = aq_sensor_next(sen), i++) {
+		const char *name = aq_sensor_name(sen);
+
+		if (strlen(name) >= AQ_ROLLUP_NAME) {
+			syslog(LOG_WARNING, "%s: Name too long for rollups (> %d characters)",
+			       name, AQ_ROLLUP_NAME - 1);
+			ro->record[i] = -1;
+			continue;
+		}
+
+		records = ro->hdr->sensors;
+		for (j = 0; j < records; j++) {
+			if (strncmp(aq_rollup_record(ro, j)->name, name, AQ_ROLLUP_NAME) == 0)
+				break;
+		}
+		if (j == records) {
+			err = aq_rollup_map(ro, fd, records + 1);
+			if (err < 0)
+				break;
+			rec = aq_rollup_record(ro, j);
+			strcpy(rec->name, name);
+			ro->hdr->sensors = records + 1;
+		}
+		ro->record[i] = j;
+	}
+	close(fd);
+
+	if (err < 0) {
+		aq_rollup_destroy(ro);
+		errno = -err;
+		return NULL;
+	}
+
+	return ro;
+}
+
+void aq_rollup_add(struct aq_rollup *ro, int id, time_t now, uint64_t reading)
+{
+	struct aq_rollup_sensor *rec;
+	struct aq_rollup_bucket *b;
+	uint32_t start;
+	int i, off = 0;
+
+	if (id < 0 || id >= ro->sensors || ro->record[id] < 0)
+		return;
+
+	rec = aq_rollup_record(ro, ro->record[id]);
+	for (i = 0; i < AQ_ROLLUP_LEVELS; off += aq_rollup_level[i].slots, i++) {
+		start = now - now % aq_rollup_level[i].secs;
+		b = &rec->bucket[off + (start / aq_rollup_level[i].secs) %
+		                 aq_rollup_level[i].slots];
+		if (b->time != start) {
+			b->time = start;
+			b->count = 0;
+			b->min = reading;
+			b->max = reading;
+			b->sum = 0;
+		}
+		b->count++;
+		b->sum += reading;
+		if (reading < b->min)
+			b->min = reading;
+		if (reading > b->max)
+			b->max = reading;
+	}
+}
+
+/* The level for 'secs', or the finest that goes back to 'from'
+ */
+static int aq_rollup_find(unsigned int secs, time_t from, time_t now)
+{
+	int i;
+
+	for (i = 0; i < AQ_ROLLUP_LEVELS; i++) {
+		if (secs != 0 && aq_rollup_level[i].secs == secs)
+			return i;
+		if (secs == 0 && now - from < (time_t)aq_rollup_level[i].secs * aq_rollup_level[i].slots)
+			return i;
+	}
+
+	return (secs == 0) ? AQ_ROLLUP_LEVELS - 1 : -EINVAL;
+}
+
+int aq_rollup_read(struct aq_rollup *ro, int id, unsigned int *secs, time_t from, time_t to,
+                   int (*bucket)(void *priv, time_t time, const struct aq_binlog_stats *st),
+                   void *priv)
+{
+	const struct aq_rollup_level *lv;
+	struct aq_rollup_sensor *rec;
+	struct aq_rollup_bucket *b;
+	struct aq_binlog_stats st;
+	time_t t, oldest, now = time(NULL);
+	int i, off = 0, err;
+
+	if (id < 0 || id >= ro->sensors)
+		return -EINVAL;
+	if (ro->record[id] < 0)
+		return -ENOENT;
+
+	i = aq_rollup_find(*secs, from, now);
+	if (i < 0)
+		return i;
+	lv = &aq_rollup_level[i];
+	*secs = lv->secs;
+	rec = aq_rollup_record(ro, ro->record[id]);
+	while (--i >= 0)
+		off += aq_rollup_level[i].slots;
+
+	/* Nothing older than one trip round the ring, or newer
+	 * than now
+	 */
+	if (to > now)
+		to = now;
+	to -= to % lv->secs;
+	oldest = now - now % lv->secs - (time_t)(lv->slots - 1) * lv->secs;
+	if (from < oldest)
+		from = oldest;
+
+	for (t = from - from % lv->secs; t <= to; t += lv->secs) {
+		b = &rec->bucket[off + (t / lv->secs) % lv->slots];
+		if (b->time != t || b->count == 0)
+			continue;
+
+		st.count = b->count;
+		st.min = b->min;
+		st.max = b->max;
+		st.sum = b->sum;
+		err = bucket(priv, t, &st);
+		if (err != 0)
+			return err;
+	}
+
+	return 0;
+}
+
+void aq_rollup_destroy(struct aq_rollup *ro)
+{
+	if (ro->hdr != NULL)
+		munmap(ro->hdr, ro->size);
+	free(ro->record);
+	free(ro);
+}
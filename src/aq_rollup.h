@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef AQ_ROLLUP_H
+#define AQ_ROLLUP_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "aquaria.h"
+
+/* Per-sensor rollups of the readings, kept in a mapped file.
+ * Sensors are known by their index in aq_sensors() order, as
+ * for the shared memory segment. Those with names of 64 or more
+ * characters are not rolled up.
+ *
+ * aq_rollup_read() calls bucket() for each bucket of '*secs'
+ * in [from, to] that has readings, oldest first, until it
+ * returns non-zero, and returns that. With '*secs' of 0, it
+ * picks the finest rollup that still goes back to 'from', and
+ * sets '*secs' to it.
+ */
+struct aq_rollup;
+
+struct aq_rollup *aq_rollup_create(struct aquaria *aq, const char *path);
+void aq_rollup_add(struct aq_rollup *ro, int id, time_t now, uint64_t reading);
+int aq_rollup_read(struct aq_rollup *ro, int id, unsigned int *secs, time_t from, time_t to,
+                   int (*bucket)(void *priv, time_t time, const struct aq_binlog_stats *st),
+                   void *priv);
+void aq_rollup_destroy(struct aq_rollup *ro);
+
+#endif /* AQ_ROLLUP_H */
@@ -7,6 +7,8 @@
  * GPL v2.0
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
@@ -24,18 +26,142 @@
 
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <sys/un.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
 #include "aquaria.h"
 #include "aq_server.h"
+#include "aq_proto.h"
+#include "uthash.h"
+
+/* Most unsent output held for a connection */
+#define AQ_SERVER_OUT_MAX	(1024 * 1024)
+
+/* Most operations in one batch request */
+#define AQ_SERVER_BATCH_MAX	1024
+
+/* Most segments handed to one sendmsg() */
+#define AQ_SERVER_IOV		64
+
+/* Most buckets in a get-history reply */
+#define AQ_SERVER_HISTORY_MAX	4096
+
+/* Largest HTTP request head, and body */
+#define AQ_SERVER_HTTP_HEAD	8192
+#define AQ_SERVER_HTTP_BODY	4096
+
+struct aq_server_buf {
+	char *buf;
+	size_t size;
+	size_t len;
+	int err;	/* First append that failed */
+};
+
+/* The sensor and device documents, rendered once for a
+ * generation of the state, and shared by every reply
+ * until the state changes.
+ */
+struct aq_server_snap {
+	struct aquaria *aq;
+	int refs;
+	unsigned int generation;
+	time_t now;		/* Override expiries are relative to this */
+	int expiring;		/* Has overrides, so is stale in a second */
+	uint64_t seq;		/* Subscription sequence number */
+
+	struct aq_server_buf text;
+	size_t seq_off;		/* '{"seq":N,' in text */
+	size_t seq_len;
+	struct aq_server_doc {
+		size_t off;		/* Whole document in text */
+		size_t len;
+		int count;
+		struct aq_server_item {
+			const char *name;
+			size_t off;	/* One object in text */
+			size_t len;
+			uint64_t changed;	/* seq when this last changed */
+			UT_hash_handle hh;
+		} *item, *items;
+	} sensor, device;
+
+	/* Binary protocol frames, rendered on first use */
+	struct aq_server_buf bin;
+	size_t schema_len;	/* Schema frame, at the start of bin */
+	size_t state_off[4];	/* STATE frame headers, by mask */
+	size_t update_off;	/* UPDATE frame header */
+	size_t sensors_off;	/* Sensor records */
+	size_t devices_off;	/* Device records */
+};
+
+static struct aq_server_snap *aq_server_snap;	/* Latest snapshot */
+static uint64_t aq_server_seq;			/* Latest snapshot seq */
+static struct aq_server_conn *aq_server_subs;	/* Subscribed connections */
+
+static const char aq_server_sensor_begin[] = "{\"sensor\":[";
+static const char aq_server_device_begin[] = "{\"device\":[";
+static const char aq_server_doc_end[] = "]}";
+static const char aq_server_invalid[] = "{}";
+static const char aq_server_push_sensor[] = "\"sensor\":[";
+static const char aq_server_push_device[] = "],\"device\":[";
+static const char aq_server_push_end[] = "]}\n";
+static const char aq_server_bin_error[AQ_FRAME_HEADER] = { 1, 0, 0, 0, AQ_FRAME_ERROR };
+
+/* One request, or one operation of a batch
+ */
+struct aq_server_op {
+	char request[16];	/* Longer than any valid request */
+	char *name;
+	enum aq_state state;
+	time_t expire;
+	uint64_t seq;
+	unsigned int step;	/* Of a get-history, s */
+	time_t from, to;
+	struct aq_device *dev;	/* Target of a set-device */
+};
 
 struct aq_server_conn {
 	struct aquaria *aq;
-	struct sockaddr saddr;
+	struct sockaddr_storage saddr;
 	socklen_t slen;
 	int sock;
+	int eof;		/* Peer is done sending */
+	enum {
+		AQ_SERVER_PROTO_NONE = 0,	/* Nothing read yet */
+		AQ_SERVER_PROTO_JSON,
+		AQ_SERVER_PROTO_MAGIC,		/* Binary, before the magic */
+		AQ_SERVER_PROTO_BINARY,
+		AQ_SERVER_PROTO_HTTP		/* From aq_server_connect_http() */
+	} proto;
+	struct aq_server_buf in;	/* Partial binary frame or HTTP request */
+	int schema_sent;
+
+	int subscribed;
+	uint64_t seq;		/* Last seq sent to a subscriber */
+	struct aq_server_conn *sub_next;	/* On aq_server_subs */
+
+	/* Output not yet sent; either static text, text
+	 * in a snapshot that the segment holds a reference
+	 * on, or text that the segment owns.
+	 */
+	struct {
+		struct aq_server_seg {
+			const char *data;
+			size_t len;
+			struct aq_server_snap *snap;
+			char *alloc;	/* Freed once sent */
+		} *seg;
+		int size;
+		int head;	/* First unsent segment */
+		int tail;	/* After the last segment */
+		size_t len;	/* Unsent bytes */
+		int err;	/* First output lost, if any */
+	} out;
 
 	json_parser parser;
 	struct {
@@ -46,34 +172,66 @@ struct aq_server_conn {
 			AQ_JKEY_TIMEOUT,
 			AQ_JKEY_UNITS,
 			AQ_JKEY_EXPIRE,
-			AQ_JKEY_ACTIVE
+			AQ_JKEY_ACTIVE,
+			AQ_JKEY_SEQ,
+			AQ_JKEY_OPS,
+			AQ_JKEY_STEP,
+			AQ_JKEY_FROM,
+			AQ_JKEY_TO
 		} key;
 		int  depth;
-		char request[PATH_MAX];
-		char name[PATH_MAX];
-		enum aq_state state;
-		time_t expire;
+		struct aq_server_op req;
+		struct aq_server_op *op;	/* Being parsed */
+		struct aq_server_op *ops;	/* Of a batch */
+		int nops;
+		int size;
 	} json;
 };
 
-static int wr_json(void *userdata, const char *s, uint32_t len)
+/* Once an append fails, the rest do nothing, so that
+ * a rendering can be checked once at the end.
+ */
+static int buf_append(struct aq_server_buf *b, const char *s, size_t len)
 {
-	struct aq_server_conn *conn = userdata;
-	int err;
+	size_t size;
+	char *buf;
 
-	err = write(conn->sock, s, len);
-	if (err < 0)
-		return -errno;
+	if (b->err < 0)
+		return b->err;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		buf = realloc(b->buf, size);
+		if (buf == NULL) {
+			b->err = -ENOMEM;
+			return b->err;
+		}
+
+		b->buf = buf;
+		b->size = size;
+	}
+
+	memcpy(&b->buf[b->len], s, len);
+	b->len += len;
 
 	return 0;
 }
 
+static int wr_json(void *userdata, const char *s, uint32_t len)
+{
+	return buf_append(userdata, s, len);
+}
+
 static int aq_server_wr_sensor(json_printer *print, struct aq_sensor *sensor)
 {
 	int len;
 	const char *cp;
 	enum aq_sensor_type type;
 	char buff[PATH_MAX];
+	unsigned int late, missed;
 
 	if (sensor == NULL)
 		return 0;
@@ -107,6 +265,15 @@ static int aq_server_wr_sensor(json_printer *print, struct aq_sensor *sensor)
 	len = strlen(cp);
 	json_print_pretty(print, JSON_STRING, cp, len);
 
+	/* late, missed */
+	aq_sensor_stats(sensor, &late, &missed);
+	json_print_pretty(print, JSON_KEY, "late", 4);
+	snprintf(buff, sizeof(buff), "%u", late);
+	json_print_pretty(print, JSON_INT, buff, strlen(buff));
+	json_print_pretty(print, JSON_KEY, "missed", 6);
+	snprintf(buff, sizeof(buff), "%u", missed);
+	json_print_pretty(print, JSON_INT, buff, strlen(buff));
+
 	json_print_pretty(print, JSON_OBJECT_END, NULL, 0);
 
 	return 0;
@@ -174,20 +341,20 @@ static int wr_json_device_condition(json_printer *print, struct aq_condition *co
 	return 0;
 }
 
-static int aq_server_wr_device(json_printer *print, struct aq_device *dev)
+static int aq_server_wr_device(json_printer *print, struct aq_device *dev, time_t now)
 {
 	int len;
 	const char *cp;
-	time_t override, now;
+	time_t override;
 	char buff[PATH_MAX];
 	enum aq_state state;
 	struct aq_condition *cond;
+	unsigned int failures;
+	int status;
 
 	if (dev == NULL)
 		return 0;
 
-	now = time(NULL);
-
 	json_print_pretty(print, JSON_OBJECT_BEGIN, NULL, 0);
 
 	/* name */
@@ -228,6 +395,15 @@ static int aq_server_wr_device(json_printer *print, struct aq_device *dev)
 		/* .. override */
 	}
 
+	/* status, failures */
+	aq_device_stats(dev, &status, &failures);
+	json_print_pretty(print, JSON_KEY, "status", 6);
+	snprintf(buff, sizeof(buff), "%d", status);
+	json_print_pretty(print, JSON_INT, buff, strlen(buff));
+	json_print_pretty(print, JSON_KEY, "failures", 8);
+	snprintf(buff, sizeof(buff), "%u", failures);
+	json_print_pretty(print, JSON_INT, buff, strlen(buff));
+
 	cond = aq_device_conditions(dev);
 	/* Disable printing device condition sets for now */
 	if (0 && cond != NULL) {
@@ -246,81 +422,1286 @@ static int aq_server_wr_device(json_printer *print, struct aq_device *dev)
 	return 0;
 }
 
-static int aq_server_respond(struct aq_server_conn *conn)
+static void aq_server_snap_put(struct aq_server_snap *snap)
+{
+	if (--snap->refs > 0)
+		return;
+
+	HASH_CLEAR(hh, snap->sensor.items);
+	HASH_CLEAR(hh, snap->device.items);
+	free(snap->sensor.item);
+	free(snap->device.item);
+	free(snap->text.buf);
+	free(snap->bin.buf);
+	free(snap);
+}
+
+/* Start a document, and its item table
+ */
+static int aq_server_doc_start(struct aq_server_snap *snap, struct aq_server_doc *doc,
+                               const char *begin, int items)
 {
+	doc->off = snap->text.len;
+	doc->item = calloc(items ? items : 1, sizeof(*doc->item));
+	if (doc->item == NULL)
+		return -ENOMEM;
+	doc->count = items;
+
+	return buf_append(&snap->text, begin, strlen(begin));
+}
+
+static void aq_server_doc_finish(struct aq_server_snap *snap, struct aq_server_doc *doc)
+{
+	buf_append(&snap->text, aq_server_doc_end, strlen(aq_server_doc_end));
+	doc->len = snap->text.len - doc->off;
+}
+
+/* Note where an object starts. Each one gets a printer of
+ * its own, so that it can also be sent by itself.
+ */
+static struct aq_server_item *aq_server_item_begin(struct aq_server_snap *snap,
+                                                   struct aq_server_doc *doc, int i,
+                                                   json_printer *print)
+{
+	struct aq_server_item *item = &doc->item[i];
 	int err;
-	json_printer print;
 
-	err = json_print_init(&print, wr_json, conn);
+	if (i > 0)
+		buf_append(&snap->text, ",", 1);
+
+	item->off = snap->text.len;
+	err = json_print_init(print, wr_json, &snap->text);
 	assert(err >= 0);
 
-	if (strcmp(conn->json.request, "set-device") == 0) {
-		struct aq_device *dev;
-		dev = aq_device_find(conn->aq, conn->json.name);
+	return item;
+}
 
-		if (dev == NULL)
-			return -EINVAL;
+static void aq_server_item_end(struct aq_server_snap *snap,
+                               struct aq_server_doc *doc,
+                               struct aq_server_item *item,
+                               json_printer *print)
+{
+	json_print_free(print);
+	item->len = snap->text.len - item->off;
+	HASH_ADD_KEYPTR(hh, doc->items, item->name, strlen(item->name), item);
+}
 
-		aq_device_set(dev, conn->json.state, &conn->json.expire);
+/* Carry over the change stamps of objects that render
+ * the same as in the previous snapshot.
+ */
+static void aq_server_doc_stamp(struct aq_server_snap *snap, struct aq_server_doc *doc,
+                                struct aq_server_snap *prev, struct aq_server_doc *prev_doc)
+{
+	struct aq_server_item *item, *old;
+	int i;
 
-		strcpy(conn->json.request, "get-device");
+	for (i = 0; i < doc->count; i++) {
+		item = &doc->item[i];
+		item->changed = snap->seq;
+
+		if (prev == NULL)
+			continue;
+
+		HASH_FIND_STR(prev_doc->items, item->name, old);
+		if (old != NULL && old->len == item->len &&
+		    memcmp(&prev->text.buf[old->off], &snap->text.buf[item->off], item->len) == 0)
+			item->changed = old->changed;
 	}
+}
 
-	if (strcmp(conn->json.request, "get-sensor") == 0) {
-		struct aq_sensor *sensor;
+static struct aq_server_snap *aq_server_snap_render(struct aquaria *aq, time_t now,
+                                                    struct aq_server_snap *prev)
+{
+	struct aq_server_snap *snap;
+	struct aq_server_item *item;
+	struct aq_sensor *sensor;
+	struct aq_device *dev;
+	json_printer print;
+	time_t override;
+	char buff[32];
+	int i, err;
 
-		json_print_pretty(&print, JSON_OBJECT_BEGIN, NULL, 0);
-		json_print_pretty(&print, JSON_KEY, "sensor", 6);
-		json_print_pretty(&print, JSON_ARRAY_BEGIN, NULL, 0);
-		if (conn->json.name[0] == 0) {
-			for (sensor = aq_sensors(conn->aq);
-			     sensor != NULL;
-			     sensor = aq_sensor_next(sensor)) {
-				aq_server_wr_sensor(&print, sensor);
-			}
-		} else {
-			sensor = aq_sensor_find(conn->aq, conn->json.name);
-			aq_server_wr_sensor(&print, sensor);
+	/* Start from the wall clock, so that a client resuming
+	 * with a seq from an earlier run gets everything.
+	 */
+	if (aq_server_seq == 0) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		aq_server_seq = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+
+	snap = calloc(1, sizeof(*snap));
+	if (snap == NULL)
+		return NULL;
+	snap->aq = aq;
+	snap->refs = 1;
+	snap->generation = aq_generation(aq);
+	snap->now = now;
+	snap->seq = ++aq_server_seq;
+
+	snprintf(buff, sizeof(buff), "{\"seq\":%" PRIu64 ",", snap->seq);
+	snap->seq_off = snap->text.len;
+	snap->seq_len = strlen(buff);
+	buf_append(&snap->text, buff, snap->seq_len);
+
+	for (i = 0, sensor = aq_sensors(aq); sensor != NULL; sensor = aq_sensor_next(sensor))
+		i++;
+	err = aq_server_doc_start(snap, &snap->sensor, aq_server_sensor_begin, i);
+	if (err < 0)
+		goto fail;
+	for (i = 0, sensor = aq_sensors(aq); sensor != NULL; sensor = aq_sensor_next(sensor), i++) {
+		item = aq_server_item_begin(snap, &snap->sensor, i, &print);
+		item->name = aq_sensor_name(sensor);
+		aq_server_wr_sensor(&print, sensor);
+		aq_server_item_end(snap, &snap->sensor, item, &print);
+	}
+	aq_server_doc_finish(snap, &snap->sensor);
+
+	for (i = 0, dev = aq_devices(aq); dev != NULL; dev = aq_device_next(dev))
+		i++;
+	err = aq_server_doc_start(snap, &snap->device, aq_server_device_begin, i);
+	if (err < 0)
+		goto fail;
+	for (i = 0, dev = aq_devices(aq); dev != NULL; dev = aq_device_next(dev), i++) {
+		aq_device_get(dev, &override);
+		if (now < override)
+			snap->expiring = 1;
+
+		item = aq_server_item_begin(snap, &snap->device, i, &print);
+		item->name = aq_device_name(dev);
+		aq_server_wr_device(&print, dev, now);
+		aq_server_item_end(snap, &snap->device, item, &print);
+	}
+	aq_server_doc_finish(snap, &snap->device);
+	if (snap->text.err < 0)
+		goto fail;
+
+	aq_server_doc_stamp(snap, &snap->sensor, prev, prev ? &prev->sensor : NULL);
+	aq_server_doc_stamp(snap, &snap->device, prev, prev ? &prev->device : NULL);
+
+	return snap;
+
+fail:
+	aq_server_snap_put(snap);
+	return NULL;
+}
+
+/* Get the snapshot of the current state, or NULL if
+ * there isn't the memory to render it
+ */
+static struct aq_server_snap *aq_server_snapshot(struct aquaria *aq)
+{
+	struct aq_server_snap *snap = aq_server_snap, *fresh;
+	time_t now = time(NULL);
+
+	if (snap != NULL && snap->aq == aq &&
+	    snap->generation == aq_generation(aq) &&
+	    (!snap->expiring || snap->now == now))
+		return snap;
+
+	if (snap != NULL && snap->aq != aq) {
+		aq_server_snap_put(snap);
+		aq_server_snap = snap = NULL;
+	}
+
+	/* Keep the last one to compare against next time */
+	fresh = aq_server_snap_render(aq, now, snap);
+	if (fresh == NULL)
+		return NULL;
+
+	aq_server_snap = fresh;
+	if (snap != NULL)
+		aq_server_snap_put(snap);
+
+	return fresh;
+}
+
+/* Queue output for aq_server_flush(). Once some is lost, the
+ * client is out of step, so the rest fails too, and the
+ * connection is closed.
+ */
+static int aq_server_queue(struct aq_server_conn *conn, const char *data, size_t len,
+                           struct aq_server_snap *snap)
+{
+	struct aq_server_seg *seg;
+	int size;
+
+	if (conn->out.err < 0)
+		return conn->out.err;
+
+	/* Don't buffer without limit for a client that never reads */
+	if (conn->out.len + len > AQ_SERVER_OUT_MAX) {
+		conn->out.err = -ENOBUFS;
+		return conn->out.err;
+	}
+
+	if (conn->out.tail == conn->out.size) {
+		size = conn->out.size ? conn->out.size * 2 : 16;
+		seg = realloc(conn->out.seg, size * sizeof(*seg));
+		if (seg == NULL) {
+			conn->out.err = -ENOMEM;
+			return conn->out.err;
 		}
-		json_print_pretty(&print, JSON_ARRAY_END, NULL, 0);
-		json_print_pretty(&print, JSON_OBJECT_END, NULL, 0);
-	} else if (strcmp(conn->json.request, "get-device") == 0) {
-		struct aq_device *dev;
-
-		json_print_pretty(&print, JSON_OBJECT_BEGIN, NULL, 0);
-		json_print_pretty(&print, JSON_KEY, "device", 6);
-		json_print_pretty(&print, JSON_ARRAY_BEGIN, NULL, 0);
-		if (conn->json.name[0] == 0) {
-			for (dev = aq_devices(conn->aq);
-			     dev != NULL;
-			     dev = aq_device_next(dev)) {
-				aq_server_wr_device(&print, dev);
-			}
+
+		conn->out.seg = seg;
+		conn->out.size = size;
+	}
+
+	seg = &conn->out.seg[conn->out.tail++];
+	seg->data = data;
+	seg->len = len;
+	seg->snap = snap;
+	seg->alloc = NULL;
+	if (snap != NULL)
+		snap->refs++;
+	conn->out.len += len;
+
+	return 0;
+}
+
+/* Reply with a whole document, or one object of it
+ */
+static int aq_server_reply(struct aq_server_conn *conn, struct aq_server_snap *snap,
+                           struct aq_server_doc *doc, const char *begin,
+                           const char *name)
+{
+	struct aq_server_item *item;
+	int err;
+
+	if (name == NULL)
+		return aq_server_queue(conn, &snap->text.buf[doc->off], doc->len, snap);
+
+	HASH_FIND_STR(doc->items, name, item);
+
+	err = aq_server_queue(conn, begin, strlen(begin), NULL);
+	if (err == 0 && item != NULL)
+		err = aq_server_queue(conn, &snap->text.buf[item->off], item->len, snap);
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_doc_end, strlen(aq_server_doc_end), NULL);
+
+	return err;
+}
+
+/* Queue the objects of a document that changed after seq
+ */
+static int aq_server_push_doc(struct aq_server_conn *conn, struct aq_server_snap *snap,
+                              struct aq_server_doc *doc, uint64_t seq)
+{
+	struct aq_server_item *item;
+	int i, err = 0, first = 1;
+
+	for (i = 0; err == 0 && i < doc->count; i++) {
+		item = &doc->item[i];
+		if (item->changed <= seq)
+			continue;
+
+		if (!first)
+			err = aq_server_queue(conn, ",", 1, NULL);
+		if (err == 0)
+			err = aq_server_queue(conn, &snap->text.buf[item->off], item->len, snap);
+		first = 0;
+	}
+
+	return err;
+}
+
+/* Count the sensors and devices changed since 'seq'
+ */
+static int aq_server_changes(struct aq_server_snap *snap, uint64_t seq)
+{
+	int i, changed = 0;
+
+	for (i = 0; i < snap->sensor.count; i++)
+		changed += (snap->sensor.item[i].changed > seq);
+	for (i = 0; i < snap->device.count; i++)
+		changed += (snap->device.item[i].changed > seq);
+
+	return changed;
+}
+
+/* Add a connection to the subscribers
+ */
+static void aq_server_subscribe(struct aq_server_conn *conn)
+{
+	if (conn->subscribed)
+		return;
+
+	conn->subscribed = 1;
+	conn->sub_next = aq_server_subs;
+	aq_server_subs = conn;
+}
+
+/* Send a subscriber what changed since the last seq it saw
+ */
+static int aq_server_push(struct aq_server_conn *conn, struct aq_server_snap *snap)
+{
+	uint64_t seq = conn->seq;
+	int changed;
+	int err;
+
+	/* From another run of the daemon, or the future */
+	if (seq > snap->seq)
+		seq = 0;
+
+	changed = aq_server_changes(snap, seq);
+	conn->seq = snap->seq;
+
+	/* Nothing to say, unless this is the first message */
+	if (changed == 0 && seq != 0)
+		return 0;
+
+	err = aq_server_queue(conn, &snap->text.buf[snap->seq_off], snap->seq_len, snap);
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_push_sensor, strlen(aq_server_push_sensor), NULL);
+	if (err == 0)
+		err = aq_server_push_doc(conn, snap, &snap->sensor, seq);
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_push_device, strlen(aq_server_push_device), NULL);
+	if (err == 0)
+		err = aq_server_push_doc(conn, snap, &snap->device, seq);
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_push_end, strlen(aq_server_push_end), NULL);
+
+	return err;
+}
+
+/* Queue the objects of a document that a batch asked for
+ */
+static int aq_server_batch_doc(struct aq_server_conn *conn, struct aq_server_snap *snap,
+                               struct aq_server_doc *doc, const char *begin,
+                               int all, const char *request, const char *set)
+{
+	struct aq_server_op *op;
+	struct aq_server_item *item;
+	int i, err = 0, first = 1;
+
+	if (all) {
+		/* The whole document, less its brackets */
+		size_t off = doc->off + strlen(begin);
+		size_t len = doc->len - strlen(begin) - strlen(aq_server_doc_end);
+
+		return aq_server_queue(conn, &snap->text.buf[off], len, snap);
+	}
+
+	for (i = 0; err == 0 && i < conn->json.nops; i++) {
+		op = &conn->json.ops[i];
+		if (strcmp(op->request, request) != 0 &&
+		    (set == NULL || strcmp(op->request, set) != 0))
+			continue;
+
+		HASH_FIND_STR(doc->items, op->name, item);
+		if (item == NULL)
+			continue;
+
+		if (!first)
+			err = aq_server_queue(conn, ",", 1, NULL);
+		if (err == 0)
+			err = aq_server_queue(conn, &snap->text.buf[item->off], item->len, snap);
+		first = 0;
+	}
+
+	return err;
+}
+
+/* Apply all of a batch between two schedule evaluations, or
+ * none of it.
+ */
+static int aq_server_batch_apply(struct aq_server_conn *conn)
+{
+	struct aq_server_op *op;
+	int i;
+
+	for (i = 0; i < conn->json.nops; i++) {
+		op = &conn->json.ops[i];
+
+		if (strcmp(op->request, "get-sensor") == 0 ||
+		    strcmp(op->request, "get-device") == 0) {
+			continue;
+		} else if (strcmp(op->request, "set-device") == 0) {
+			if (op->name != NULL)
+				op->dev = aq_device_find(conn->aq, op->name);
+			if (op->dev == NULL)
+				break;
 		} else {
-			dev = aq_device_find(conn->aq, conn->json.name);
-			aq_server_wr_device(&print, dev);
+			break;
+		}
+	}
+
+	if (i < conn->json.nops) {
+		fprintf(stderr, "WARNING: Invalid batch operation %d \"%s\"\n", i, op->request);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < conn->json.nops; i++) {
+		op = &conn->json.ops[i];
+		if (op->dev != NULL)
+			aq_device_set(op->dev, op->state, &op->expire);
+	}
+
+	return 0;
+}
+
+/* Answer a batch with everything it asked for in one reply
+ */
+static int aq_server_batch(struct aq_server_conn *conn)
+{
+	struct aq_server_snap *snap;
+	struct aq_server_op *op;
+	int all_sensors = 0, all_devices = 0;
+	int i, err;
+
+	if (aq_server_batch_apply(conn) < 0) {
+		aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < conn->json.nops; i++) {
+		op = &conn->json.ops[i];
+		if (op->name != NULL)
+			continue;
+		if (strcmp(op->request, "get-sensor") == 0)
+			all_sensors = 1;
+		else if (strcmp(op->request, "get-device") == 0)
+			all_devices = 1;
+	}
+
+	snap = aq_server_snapshot(conn->aq);
+	if (snap == NULL) {
+		aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		return -ENOMEM;
+	}
+	err = aq_server_queue(conn, aq_server_sensor_begin, strlen(aq_server_sensor_begin), NULL);
+	if (err == 0)
+		err = aq_server_batch_doc(conn, snap, &snap->sensor, aq_server_sensor_begin,
+		                          all_sensors, "get-sensor", NULL);
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_push_device, strlen(aq_server_push_device), NULL);
+	if (err == 0)
+		err = aq_server_batch_doc(conn, snap, &snap->device, aq_server_device_begin,
+		                          all_devices, "get-device", "set-device");
+	if (err == 0)
+		err = aq_server_queue(conn, aq_server_doc_end, strlen(aq_server_doc_end), NULL);
+
+	return err;
+}
+
+struct aq_server_history {
+	struct aq_server_buf text;
+	int skip;		/* Buckets to leave out */
+	int count;
+};
+
+static int aq_server_history_count(void *priv, time_t time, const struct aq_binlog_stats *st)
+{
+	struct aq_server_history *hist = priv;
+
+	hist->count++;
+	return 0;
+}
+
+static int aq_server_history_bucket(void *priv, time_t time, const struct aq_binlog_stats *st)
+{
+	struct aq_server_history *hist = priv;
+	char buff[160];
+	int len;
+
+	if (hist->skip > 0) {
+		hist->skip--;
+		return 0;
+	}
+
+	len = snprintf(buff, sizeof(buff), "%s{\"time\":%" PRId64 ",\"min\":%" PRIu64
+	               ",\"max\":%" PRIu64 ",\"mean\":%" PRIu64 ",\"count\":%" PRIu64 "}",
+	               hist->count++ ? "," : "", (int64_t)time, st->min, st->max,
+	               st->sum / st->count, st->count);
+
+	return buf_append(&hist->text, buff, len);
+}
+
+/* Answer a get-history with the newest buckets of the range,
+ * from an hour before "to" (or now) unless asked.
+ */
+static int aq_server_history(struct aq_server_conn *conn, struct aq_server_op *op)
+{
+	struct aq_server_history hist = { };
+	struct aq_sensor *sen = NULL;
+	json_printer print;
+	time_t to, from, now = time(NULL);
+	unsigned int step;
+	char buff[64];
+	int len, err;
+
+	if (op->name != NULL)
+		sen = aq_sensor_find(conn->aq, op->name);
+
+	to = (op->to && op->to < now) ? op->to : now;
+	from = op->from ? op->from : to - 3599;
+
+	/* Count them first, so that the oldest are left out */
+	step = op->step;
+	err = (sen == NULL) ? -ENOENT :
+	      aq_sensor_history(conn->aq, sen, &step, from, to, aq_server_history_count, &hist);
+	if (err < 0)
+		return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+
+	hist.skip = hist.count - AQ_SERVER_HISTORY_MAX;
+	hist.count = 0;
+
+	/* The name is the only part that may need escaping */
+	err = buf_append(&hist.text, "{\"history\":{\"name\":", 19);
+	if (err == 0) {
+		json_print_init(&print, wr_json, &hist.text);
+		err = json_print_raw(&print, JSON_STRING, aq_sensor_name(sen),
+		                     strlen(aq_sensor_name(sen)));
+		json_print_free(&print);
+	}
+	len = snprintf(buff, sizeof(buff), ",\"step\":%u,\"units\":\"%s\",\"bucket\":[",
+	               step, aq_sensor_typeunits(aq_sensor_type(sen)));
+	if (err == 0)
+		err = buf_append(&hist.text, buff, len);
+	if (err == 0)
+		err = aq_sensor_history(conn->aq, sen, &step, from, to,
+		                        aq_server_history_bucket, &hist);
+	if (err == 0)
+		err = buf_append(&hist.text, "]}}", 3);
+	if (err == 0)
+		err = aq_server_queue(conn, hist.text.buf, hist.text.len, NULL);
+	if (err < 0) {
+		free(hist.text.buf);
+		/* Still answer, unless the answer is what was lost */
+		if (conn->out.err == 0)
+			aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		return err;
+	}
+
+	conn->out.seg[conn->out.tail - 1].alloc = hist.text.buf;
+
+	return 0;
+}
+
+static int aq_server_respond(struct aq_server_conn *conn)
+{
+	struct aq_server_op *op = &conn->json.req;
+	struct aq_server_snap *snap;
+	int err;
+
+	if (strcmp(op->request, "batch") == 0)
+		return aq_server_batch(conn);
+
+	if (strcmp(op->request, "set-device") == 0) {
+		if (op->name != NULL)
+			op->dev = aq_device_find(conn->aq, op->name);
+
+		if (op->dev == NULL) {
+			/* Still answer, so the client stays in step */
+			aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+			return -EINVAL;
 		}
-		json_print_pretty(&print, JSON_ARRAY_END, NULL, 0);
-		json_print_pretty(&print, JSON_OBJECT_END, NULL, 0);
+
+		aq_device_set(op->dev, op->state, &op->expire);
+
+		strcpy(op->request, "get-device");
+	}
+
+	if (strcmp(op->request, "get-sensor") == 0) {
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL)
+			goto nomem;
+		err = aq_server_reply(conn, snap, &snap->sensor, aq_server_sensor_begin, op->name);
+	} else if (strcmp(op->request, "get-device") == 0) {
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL)
+			goto nomem;
+		err = aq_server_reply(conn, snap, &snap->device, aq_server_device_begin, op->name);
+	} else if (strcmp(op->request, "subscribe") == 0) {
+		aq_server_subscribe(conn);
+		conn->seq = op->seq;
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL)
+			goto nomem;
+		err = aq_server_push(conn, snap);
+	} else if (strcmp(op->request, "get-history") == 0) {
+		err = aq_server_history(conn, op);
 	} else {
+		fprintf(stderr, "WARNING: Invalid request \"%s\"\n", op->request);
+		aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
 		err = -EINVAL;
 	}
 
-	if (err < 0) {
-		fprintf(stderr, "WARNING: Invalid request \"%s\"\n", conn->json.request);
-		json_print_pretty(&print, JSON_OBJECT_BEGIN, NULL, 0);
-		json_print_pretty(&print, JSON_OBJECT_END, NULL, 0);
+	return err;
+
+nomem:
+	/* No snapshot to answer from; answer all the same */
+	aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	return -ENOMEM;
+}
+
+/* Forget the last request, keeping the batch table
+ */
+static void aq_server_json_reset(struct aq_server_conn *conn)
+{
+	int i;
+
+	free(conn->json.req.name);
+	memset(&conn->json.req, 0, sizeof(conn->json.req));
+	for (i = 0; i < conn->json.nops; i++)
+		free(conn->json.ops[i].name);
+	conn->json.nops = 0;
+	conn->json.op = &conn->json.req;
+	conn->json.key = AQ_JKEY_INVALID;
+}
+
+/* Start the next operation of a batch
+ */
+static struct aq_server_op *aq_server_json_op(struct aq_server_conn *conn)
+{
+	struct aq_server_op *ops;
+	int size;
+
+	if (conn->json.nops == AQ_SERVER_BATCH_MAX)
+		return NULL;
+
+	if (conn->json.nops == conn->json.size) {
+		size = conn->json.size ? conn->json.size * 2 : 16;
+		ops = realloc(conn->json.ops, size * sizeof(*ops));
+		if (ops == NULL)
+			return NULL;
+
+		conn->json.ops = ops;
+		conn->json.size = size;
 	}
 
-	json_print_free(&print);
+	ops = &conn->json.ops[conn->json.nops++];
+	memset(ops, 0, sizeof(*ops));
+
+	return ops;
+}
+
+/* Render the binary frames of a snapshot, if they haven't
+ * been already. Returns -ENOMEM if they couldn't be.
+ */
+static int aq_server_snap_bin(struct aq_server_snap *snap)
+{
+	struct aq_server_buf *b = &snap->bin;
+	struct aq_sensor *sensor;
+	struct aq_device *dev;
+	enum aq_state state;
+	time_t override;
+	uint8_t rec[AQ_FRAME_SENSOR_LEN] = {};
+	uint8_t len;
+	int i, mask;
+
+	if (b->len > 0)
+		return 0;
+
+	/* Schema: u16 count, then u8 type, u8 length, name for each
+	 * sensor; u16 count, then u8 length, name for each device.
+	 * aq_config_read() keeps names to AQ_FRAME_NAME_MAX.
+	 */
+	buf_append(b, (const char *)rec, AQ_FRAME_HEADER);
+	aq_put_le16(rec, snap->sensor.count);
+	buf_append(b, (const char *)rec, 2);
+	for (sensor = aq_sensors(snap->aq); sensor != NULL; sensor = aq_sensor_next(sensor)) {
+		len = strlen(aq_sensor_name(sensor));
+		rec[0] = aq_sensor_type(sensor);
+		rec[1] = len;
+		buf_append(b, (const char *)rec, 2);
+		buf_append(b, aq_sensor_name(sensor), len);
+	}
+	aq_put_le16(rec, snap->device.count);
+	buf_append(b, (const char *)rec, 2);
+	for (dev = aq_devices(snap->aq); dev != NULL; dev = aq_device_next(dev)) {
+		len = strlen(aq_device_name(dev));
+		buf_append(b, (const char *)&len, 1);
+		buf_append(b, aq_device_name(dev), len);
+	}
+	if (b->err < 0)
+		goto fail;
+	snap->schema_len = b->len;
+	aq_put_le32((uint8_t *)b->buf, b->len - 4);
+	b->buf[4] = AQ_FRAME_SCHEMA;
+
+	/* A STATE frame header for each combination of parts */
+	for (mask = 1; mask < 4; mask++) {
+		uint32_t flen = 2;
+
+		if (mask & AQ_FRAME_SENSORS)
+			flen += snap->sensor.count * AQ_FRAME_SENSOR_LEN;
+		if (mask & AQ_FRAME_DEVICES)
+			flen += snap->device.count * AQ_FRAME_DEVICE_LEN;
+
+		snap->state_off[mask] = b->len;
+		aq_put_le32(rec, flen);
+		rec[4] = AQ_FRAME_STATE;
+		rec[5] = mask;
+		buf_append(b, (const char *)rec, AQ_FRAME_HEADER + 1);
+	}
+
+	/* Pushed to subscribers; the same as the last, with
+	 * everything, but for the type
+	 */
+	snap->update_off = b->len;
+	rec[4] = AQ_FRAME_UPDATE;
+	buf_append(b, (const char *)rec, AQ_FRAME_HEADER + 1);
+
+	snap->sensors_off = b->len;
+	for (sensor = aq_sensors(snap->aq); sensor != NULL; sensor = aq_sensor_next(sensor)) {
+		unsigned int late, missed;
+
+		aq_sensor_stats(sensor, &late, &missed);
+		aq_put_le64(&rec[0], aq_sensor_reading(sensor));
+		aq_put_le32(&rec[8], late);
+		aq_put_le32(&rec[12], missed);
+		buf_append(b, (const char *)rec, AQ_FRAME_SENSOR_LEN);
+	}
+
+	snap->devices_off = b->len;
+	for (i = 0, dev = aq_devices(snap->aq); dev != NULL; dev = aq_device_next(dev), i++) {
+		state = aq_device_get(dev, &override);
+		rec[0] = (state == AQ_STATE_UNCHANGED) ? AQ_FRAME_STATE_NONE : state;
+		rec[1] = AQ_FRAME_STATE_NONE;
+		aq_put_le32(&rec[2], 0);
+		if (override > snap->now) {
+			rec[1] = (state == AQ_STATE_ON);
+			aq_put_le32(&rec[2], override - snap->now);
+		}
+		buf_append(b, (const char *)rec, AQ_FRAME_DEVICE_LEN);
+	}
+	if (b->err < 0)
+		goto fail;
+
+	return 0;
+
+fail:
+	/* Start over if it is asked for again */
+	free(b->buf);
+	memset(b, 0, sizeof(*b));
+	return -ENOMEM;
+}
+
+/* Reply with a STATE frame, after the schema if the
+ * client has not had it yet.
+ */
+static int aq_server_bin_state(struct aq_server_conn *conn, int mask)
+{
+	struct aq_server_snap *snap;
+	int err = 0;
+
+	snap = aq_server_snapshot(conn->aq);
+	if (snap == NULL || aq_server_snap_bin(snap) < 0)
+		return aq_server_queue(conn, aq_server_bin_error, AQ_FRAME_HEADER, NULL);
+
+	if (!conn->schema_sent) {
+		err = aq_server_queue(conn, snap->bin.buf, snap->schema_len, snap);
+		conn->schema_sent = 1;
+	}
+	if (err == 0)
+		err = aq_server_queue(conn, &snap->bin.buf[snap->state_off[mask]],
+		                      AQ_FRAME_HEADER + 1, snap);
+	if (err == 0 && (mask & AQ_FRAME_SENSORS))
+		err = aq_server_queue(conn, &snap->bin.buf[snap->sensors_off],
+		                      snap->sensor.count * AQ_FRAME_SENSOR_LEN, snap);
+	if (err == 0 && (mask & AQ_FRAME_DEVICES))
+		err = aq_server_queue(conn, &snap->bin.buf[snap->devices_off],
+		                      snap->device.count * AQ_FRAME_DEVICE_LEN, snap);
 
 	return err;
 }
 
+/* Send a binary subscriber the whole state, if any of it
+ * has changed since the last it saw
+ */
+static int aq_server_bin_push(struct aq_server_conn *conn, struct aq_server_snap *snap)
+{
+	int err;
+
+	if (aq_server_changes(snap, conn->seq) == 0)
+		return 0;
+
+	/* Left to catch up with the next change */
+	if (aq_server_snap_bin(snap) < 0)
+		return 0;
+	conn->seq = snap->seq;
+
+	err = aq_server_queue(conn, &snap->bin.buf[snap->update_off],
+	                      AQ_FRAME_HEADER + 1, snap);
+	if (err == 0)
+		err = aq_server_queue(conn, &snap->bin.buf[snap->sensors_off],
+		                      snap->sensor.count * AQ_FRAME_SENSOR_LEN, snap);
+	if (err == 0)
+		err = aq_server_queue(conn, &snap->bin.buf[snap->devices_off],
+		                      snap->device.count * AQ_FRAME_DEVICE_LEN, snap);
+
+	return err;
+}
+
+/* Handle one binary frame. Returns < 0 if the connection
+ * should be closed.
+ */
+static int aq_server_bin_frame(struct aq_server_conn *conn, int type,
+                               const uint8_t *data, uint32_t len)
+{
+	struct aq_server_snap *snap;
+	struct aq_server_op *op;
+	unsigned int id;
+	int mask;
+
+	switch (type) {
+	case AQ_FRAME_GET:
+		mask = (len > 0) ? (data[0] & 3) : 0;
+		return aq_server_bin_state(conn, mask ? mask : 3);
+	case AQ_FRAME_SUBSCRIBE:
+		aq_server_subscribe(conn);
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL)
+			return aq_server_queue(conn, aq_server_bin_error, AQ_FRAME_HEADER, NULL);
+		conn->seq = snap->seq;
+		return aq_server_bin_state(conn, 3);
+	case AQ_FRAME_SET:
+	case AQ_FRAME_BATCH:
+		if (len == 0 || (len % AQ_FRAME_SET_LEN) != 0 ||
+		    (type == AQ_FRAME_SET && len != AQ_FRAME_SET_LEN))
+			return -EINVAL;
+
+		/* Same rules as a JSON batch */
+		aq_server_json_reset(conn);
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL)
+			return aq_server_queue(conn, aq_server_bin_error, AQ_FRAME_HEADER, NULL);
+		for (; len > 0; data += AQ_FRAME_SET_LEN, len -= AQ_FRAME_SET_LEN) {
+			op = aq_server_json_op(conn);
+			if (op == NULL)
+				return -EINVAL;
+
+			strcpy(op->request, "set-device");
+			id = aq_get_le16(&data[0]);
+			if (id < snap->device.count)
+				op->name = strdup(snap->device.item[id].name);
+			op->state = data[2] ? AQ_STATE_ON : AQ_STATE_OFF;
+			op->expire = aq_get_le32(&data[3]);
+		}
+
+		if (aq_server_batch_apply(conn) < 0)
+			return aq_server_queue(conn, aq_server_bin_error, AQ_FRAME_HEADER, NULL);
+
+		return aq_server_bin_state(conn, AQ_FRAME_DEVICES);
+	default:
+		fprintf(stderr, "WARNING: Invalid frame type 0x%02x\n", type);
+		return -EINVAL;
+	}
+}
+
+/* Take in binary protocol input, and handle the whole frames
+ */
+static int aq_server_bin_input(struct aq_server_conn *conn, const char *data, size_t len)
+{
+	const uint8_t *frame;
+	size_t off = 0;
+	uint32_t flen;
+	int err;
+
+	err = buf_append(&conn->in, data, len);
+	if (err < 0)
+		return err;
+
+	if (conn->proto == AQ_SERVER_PROTO_MAGIC) {
+		if (conn->in.len < AQ_PROTO_MAGIC_LEN)
+			return 0;
+		if (memcmp(conn->in.buf, AQ_PROTO_MAGIC, AQ_PROTO_MAGIC_LEN) != 0)
+			return -EINVAL;
+
+		err = aq_server_queue(conn, AQ_PROTO_MAGIC, AQ_PROTO_MAGIC_LEN, NULL);
+		if (err < 0)
+			return err;
+		off = AQ_PROTO_MAGIC_LEN;
+		conn->proto = AQ_SERVER_PROTO_BINARY;
+	}
+
+	while (conn->in.len - off >= AQ_FRAME_HEADER) {
+		frame = (const uint8_t *)&conn->in.buf[off];
+		flen = aq_get_le32(frame);
+		if (flen < 1 || flen > AQ_FRAME_MAX)
+			return -EINVAL;
+		if (conn->in.len - off - 4 < flen)
+			break;
+
+		err = aq_server_bin_frame(conn, frame[4], &frame[AQ_FRAME_HEADER], flen - 1);
+		if (err < 0)
+			return err;
+
+		off += 4 + flen;
+	}
+
+	memmove(conn->in.buf, &conn->in.buf[off], conn->in.len - off);
+	conn->in.len -= off;
+
+	return 0;
+}
+
+/* HTTP/1.1, see doc/Protocol.txt
+ *
+ * Each request is turned into a JSON protocol request,
+ * and answered by aq_server_respond().
+ */
+struct aq_server_http {
+	int version;		/* Minor version, 0 or 1 */
+	int keepalive;
+	int status;
+	char method[8];
+	const char *allow;	/* Methods, for a 405 */
+	const char *body;	/* Of a POST */
+	size_t body_len;
+	char path[PATH_MAX];	/* Decoded, without any query */
+	char query[256];	/* As sent */
+};
+
+static const char *aq_server_http_reason(int status)
+{
+	switch (status) {
+	case 200: return "OK";
+	case 400: return "Bad Request";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 413: return "Payload Too Large";
+	default:  return "Internal Server Error";
+	}
+}
+
+/* Find a header in a request head. The value runs to
+ * the end of its line.
+ */
+static const char *aq_server_http_header(const char *head, size_t len, const char *name)
+{
+	const char *line, *end = head + len;
+	size_t nlen = strlen(name);
+
+	for (line = memchr(head, '\n', len); line != NULL;
+	     line = memchr(line, '\n', end - line)) {
+		line++;
+		if ((size_t)(end - line) <= nlen ||
+		    strncasecmp(line, name, nlen) != 0 || line[nlen] != ':')
+			continue;
+
+		for (line += nlen + 1; line < end && (*line == ' ' || *line == '\t'); line++)
+			;
+		return line;
+	}
+
+	return NULL;
+}
+
+/* Copy out the path of a request target, undoing %XX escapes
+ */
+static int aq_server_http_path(char *path, size_t size, const char *target, size_t len)
+{
+	unsigned int c;
+	size_t i, n = 0;
+
+	for (i = 0; i < len && target[i] != '?' && target[i] != '#'; i++) {
+		c = target[i];
+		if (c == '%') {
+			if (i + 2 >= len || sscanf(&target[i + 1], "%2x", &c) != 1 || c == 0)
+				return -EINVAL;
+			i += 2;
+		}
+		if (n + 1 == size)
+			return -EINVAL;
+		path[n++] = c;
+	}
+	path[n] = 0;
+
+	return 0;
+}
+
+/* Queue the status line and headers in front of the body
+ * that was queued after the slot was reserved.
+ */
+static int aq_server_http_finish(struct aq_server_conn *conn, struct aq_server_http *req,
+                                 int slot, size_t start)
+{
+	struct aq_server_seg *seg;
+	size_t len = conn->out.len - start;
+	int chunked = (req->version > 0);
+	char *head;
+	int hlen;
+
+	head = malloc(256);
+	if (head == NULL)
+		return -ENOMEM;
+
+	hlen = snprintf(head, 256, "HTTP/1.1 %d %s\r\n"
+	                "Content-Type: application/json\r\n"
+	                "Cache-Control: no-cache\r\n%s%s%s%s",
+	                req->status, aq_server_http_reason(req->status),
+	                (req->status == 405) ? "Allow: " : "",
+	                (req->status == 405) ? req->allow : "",
+	                (req->status == 405) ? "\r\n" : "",
+	                !req->keepalive ? "Connection: close\r\n" :
+	                (req->version == 0) ? "Connection: keep-alive\r\n" : "");
+	if (!chunked)
+		hlen += snprintf(&head[hlen], 256 - hlen, "Content-Length: %zu\r\n\r\n", len);
+	else if (len > 0)
+		hlen += snprintf(&head[hlen], 256 - hlen, "Transfer-Encoding: chunked\r\n\r\n%zx\r\n", len);
+	else
+		hlen += snprintf(&head[hlen], 256 - hlen, "Transfer-Encoding: chunked\r\n\r\n");
+
+	seg = &conn->out.seg[slot];
+	seg->data = head;
+	seg->len = hlen;
+	seg->alloc = head;
+	conn->out.len += hlen;
+
+	if (!chunked)
+		return 0;
+
+	return (len > 0) ? aq_server_queue(conn, "\r\n0\r\n\r\n", 7, NULL) :
+	                   aq_server_queue(conn, "0\r\n\r\n", 5, NULL);
+}
+
+/* GET /history/<name>?step=S&from=T&to=T is a get-history
+ */
+static int aq_server_http_history(struct aq_server_conn *conn, struct aq_server_http *req)
+{
+	struct aq_server_op *op = &conn->json.req;
+	const char *name = &req->path[9];
+	char *key, *val, *save;
+
+	req->allow = "GET";
+	if (strcmp(req->method, "GET") != 0) {
+		req->status = 405;
+		return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	}
+
+	if (aq_sensor_find(conn->aq, name) == NULL) {
+		req->status = 404;
+		return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	}
+
+	aq_server_json_reset(conn);
+	strcpy(op->request, "get-history");
+	op->name = strdup(name);
+
+	for (key = strtok_r(req->query, "&", &save); key != NULL;
+	     key = strtok_r(NULL, "&", &save)) {
+		val = strchr(key, '=');
+		if (val == NULL)
+			continue;
+		*val++ = 0;
+		if (strcmp(key, "step") == 0)
+			op->step = strtoul(val, NULL, 10);
+		else if (strcmp(key, "from") == 0)
+			op->from = (time_t)strtoll(val, NULL, 10);
+		else if (strcmp(key, "to") == 0)
+			op->to = (time_t)strtoll(val, NULL, 10);
+	}
+
+	req->status = 200;
+	return aq_server_respond(conn);
+}
+
+/* Map a request onto the JSON protocol, and queue its body
+ */
+static int aq_server_http_route(struct aq_server_conn *conn, struct aq_server_http *req)
+{
+	struct aq_server_op *op = &conn->json.req;
+	struct aq_server_snap *snap;
+	struct aq_server_doc *doc;
+	struct aq_server_item *item;
+	const char *request, *name;
+	int devices, err;
+
+	if (strncmp(req->path, "/history/", 9) == 0)
+		return aq_server_http_history(conn, req);
+
+	req->allow = "GET, POST";
+	if (strncmp(req->path, "/sensor", 7) == 0 &&
+	    (req->path[7] == 0 || req->path[7] == '/')) {
+		devices = 0;
+	} else if (strncmp(req->path, "/device", 7) == 0 &&
+	           (req->path[7] == 0 || req->path[7] == '/')) {
+		devices = 1;
+	} else {
+		req->status = 404;
+		return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	}
+
+	/* '/sensor' and '/sensor/' are the whole document */
+	name = &req->path[7];
+	if (name[0] == '/')
+		name++;
+	if (name[0] == 0)
+		name = NULL;
+
+	if (strcmp(req->method, "GET") == 0) {
+		request = devices ? "get-device" : "get-sensor";
+	} else if (strcmp(req->method, "POST") == 0 && devices && name != NULL) {
+		request = "set-device";
+	} else {
+		req->status = 405;
+		return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	}
+
+	if (name != NULL) {
+		snap = aq_server_snapshot(conn->aq);
+		if (snap == NULL) {
+			req->status = 500;
+			return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		}
+		doc = devices ? &snap->device : &snap->sensor;
+		HASH_FIND_STR(doc->items, name, item);
+		if (item == NULL) {
+			req->status = 404;
+			return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		}
+	}
+
+	/* The body of a POST is a set-device request, less
+	 * its "request" and "name".
+	 */
+	aq_server_json_reset(conn);
+	if (strcmp(request, "set-device") == 0) {
+		err = json_parser_string(&conn->parser, req->body, req->body_len, NULL);
+		if (req->body_len == 0 || err || conn->json.depth != 0) {
+			req->status = 400;
+			req->keepalive = 0;
+			return aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+		}
+	}
+
+	strcpy(op->request, request);
+	free(op->name);
+	op->name = (name != NULL) ? strdup(name) : NULL;
+
+	req->status = 200;
+	return aq_server_respond(conn);
+}
+
+/* Answer one whole request. Returns how much of the input
+ * it took, 0 if it needs more, or < 0 if the connection
+ * should be closed.
+ */
+static ssize_t aq_server_http_request(struct aq_server_conn *conn, const char *head, size_t len)
+{
+	struct aq_server_http req = { .status = 400 };
+	const char *end, *target, *version, *cp;
+	size_t hlen, tlen, start;
+	unsigned long clen = 0;
+	int slot, err;
+
+	end = memmem(head, (len < AQ_SERVER_HTTP_HEAD) ? len : AQ_SERVER_HTTP_HEAD, "\r\n\r\n", 4);
+	if (end == NULL && len < AQ_SERVER_HTTP_HEAD)
+		return 0;
+
+	if (end == NULL) {
+		/* Too long to be a request; answer, then hang up */
+		hlen = len;
+	} else {
+		hlen = end + 4 - head;
+
+		cp = aq_server_http_header(head, hlen, "Content-Length");
+		if (cp != NULL)
+			clen = strtoul(cp, NULL, 10);
+		if (clen > AQ_SERVER_HTTP_BODY) {
+			req.status = 413;
+			clen = 0;
+		} else if (len < hlen + clen) {
+			return 0;
+		}
+		req.body = head + hlen;
+		req.body_len = clen;
+
+		/* Request line: METHOD SP target SP HTTP/1.x */
+		target = memchr(head, ' ', hlen);
+		version = target ? memchr(target + 1, ' ', end - target - 1) : NULL;
+		if (version != NULL) {
+			snprintf(req.method, sizeof(req.method), "%.*s", (int)(target - head), head);
+			target++;
+			tlen = version - target;
+			version++;
+			if (strncmp(version, "HTTP/1.", 7) == 0 &&
+			    (version[7] == '0' || version[7] == '1') && version[8] == '\r' &&
+			    aq_server_http_path(req.path, sizeof(req.path), target, tlen) == 0) {
+				cp = memchr(target, '?', tlen);
+				if (cp != NULL)
+					snprintf(req.query, sizeof(req.query), "%.*s",
+					         (int)(target + tlen - cp - 1), cp + 1);
+				req.version = version[7] - '0';
+				if (req.status != 413)
+					req.status = 0;
+			}
+		}
+	}
+
+	/* HTTP/1.1 stays open unless asked, HTTP/1.0 the other way */
+	cp = aq_server_http_header(head, hlen, "Connection");
+	if (req.version > 0)
+		req.keepalive = (cp == NULL || strncasecmp(cp, "close", 5) != 0);
+	else
+		req.keepalive = (cp != NULL && strncasecmp(cp, "keep-alive", 10) == 0);
+
+	/* Reserve a slot for the head, which needs the body's length */
+	start = conn->out.len;
+	err = aq_server_queue(conn, NULL, 0, NULL);
+	if (err < 0)
+		return err;
+	slot = conn->out.tail - 1;
+
+	if (req.status == 0) {
+		err = aq_server_http_route(conn, &req);
+		if (err < 0 && req.status == 200)
+			req.status = 500;
+	} else {
+		req.keepalive = 0;
+		err = aq_server_queue(conn, aq_server_invalid, strlen(aq_server_invalid), NULL);
+	}
+	if (conn->out.err < 0)
+		return conn->out.err;
+
+	if (!req.keepalive)
+		conn->eof = 1;
+
+	err = aq_server_http_finish(conn, &req, slot, start);
+	if (err < 0)
+		return err;
+
+	return hlen + clen;
+}
+
+/* Take in HTTP input, and answer the whole requests
+ */
+static int aq_server_http_input(struct aq_server_conn *conn, const char *data, size_t len)
+{
+	size_t off = 0;
+	ssize_t used;
+	int err;
 
+	err = buf_append(&conn->in, data, len);
+	if (err < 0)
+		return err;
+
+	while (!conn->eof && off < conn->in.len) {
+		used = aq_server_http_request(conn, &conn->in.buf[off], conn->in.len - off);
+		if (used < 0)
+			return used;
+		if (used == 0)
+			break;
+		off += used;
+	}
+
+	memmove(conn->in.buf, &conn->in.buf[off], conn->in.len - off);
+	conn->in.len -= off;
+
+	return 0;
+}
+
+/* Requests are an object at depth 1. The operations of a
+ * batch are objects at depth 3, in the "ops" array at depth 2.
+ */
 static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 {
 	struct aq_server_conn *conn = userdata;
+	struct aq_server_op *op;
 	char *cp;
 	int err = 0;
 
@@ -329,11 +1710,19 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 		return -EINVAL;
 
 	if (conn->json.depth == 0)
-		memset(&conn->json, 0, sizeof(conn->json));
+		aq_server_json_reset(conn);
+
+	op = conn->json.op;
 
 	switch (type) {
 	case JSON_OBJECT_BEGIN:
-		if (conn->json.depth > 0) {
+		if (conn->json.depth == 2) {
+			conn->json.op = aq_server_json_op(conn);
+			if (conn->json.op == NULL) {
+				err=-EINVAL;
+				break;
+			}
+		} else if (conn->json.depth > 0) {
 			err=-EINVAL;
 			break;
 		}
@@ -342,15 +1731,39 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 		break;
 	case JSON_OBJECT_END:
 		conn->json.depth--;
-		if (conn->json.depth == 0) {
+		conn->json.key = AQ_JKEY_INVALID;
+		if (conn->json.depth == 0 && conn->proto == AQ_SERVER_PROTO_HTTP) {
+			/* The body of a POST, answered by the caller */
+		} else if (conn->json.depth == 0) {
 			aq_server_respond(conn);
-			err = write(conn->sock, "\n", 1);
-			if (err > 0)
-				err = 0;
+
+			/* Pushed updates end with their own newline */
+			if (strcmp(conn->json.req.request, "subscribe") != 0)
+				aq_server_queue(conn, "\n", 1, NULL);
+
+			/* Invalid requests were answered; lost answers weren't */
+			if (conn->out.err < 0)
+				return conn->out.err;
 		}
 		break;
+	case JSON_ARRAY_BEGIN:
+		if (conn->json.depth != 1 || conn->json.key != AQ_JKEY_OPS) {
+			err=-EINVAL;
+			break;
+		}
+		conn->json.depth++;
+		break;
+	case JSON_ARRAY_END:
+		if (conn->json.depth != 2) {
+			err=-EINVAL;
+			break;
+		}
+		conn->json.depth--;
+		conn->json.op = &conn->json.req;
+		conn->json.key = AQ_JKEY_INVALID;
+		break;
 	case JSON_KEY:
-		if (conn->json.depth == 1) {
+		if (conn->json.depth == 1 || conn->json.depth == 3) {
 			if (strcmp(data, "request") == 0) {
 				conn->json.key = AQ_JKEY_REQUEST;
 			} else if (strcmp(data, "name") == 0) {
@@ -359,6 +1772,16 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 				conn->json.key = AQ_JKEY_ACTIVE;
 			} else if (strcmp(data, "expire") == 0) {
 				conn->json.key = AQ_JKEY_EXPIRE;
+			} else if (strcmp(data, "seq") == 0) {
+				conn->json.key = AQ_JKEY_SEQ;
+			} else if (strcmp(data, "step") == 0) {
+				conn->json.key = AQ_JKEY_STEP;
+			} else if (strcmp(data, "from") == 0) {
+				conn->json.key = AQ_JKEY_FROM;
+			} else if (strcmp(data, "to") == 0) {
+				conn->json.key = AQ_JKEY_TO;
+			} else if (conn->json.depth == 1 && strcmp(data, "ops") == 0) {
+				conn->json.key = AQ_JKEY_OPS;
 			} else {
 				err=-EINVAL;
 				break;
@@ -369,8 +1792,16 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 		}
 		break;
 	case JSON_INT:
-		if (conn->json.depth == 1 && conn->json.key == AQ_JKEY_EXPIRE) {
-			conn->json.expire = (time_t)strtoull(data, NULL, 0);
+		if (conn->json.key == AQ_JKEY_EXPIRE) {
+			op->expire = (time_t)strtoull(data, NULL, 0);
+		} else if (conn->json.key == AQ_JKEY_SEQ) {
+			op->seq = strtoull(data, NULL, 0);
+		} else if (conn->json.key == AQ_JKEY_STEP) {
+			op->step = strtoul(data, NULL, 0);
+		} else if (conn->json.key == AQ_JKEY_FROM) {
+			op->from = (time_t)strtoll(data, NULL, 0);
+		} else if (conn->json.key == AQ_JKEY_TO) {
+			op->to = (time_t)strtoll(data, NULL, 0);
 		} else {
 			err=-EINVAL;
 			break;
@@ -379,7 +1810,7 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 	case JSON_STRING:
 		cp = NULL;
 		len = 0;
-		if (conn->json.depth != 1) {
+		if (conn->json.depth != 1 && conn->json.depth != 3) {
 			err=-EINVAL;
 			break;
 		} else switch (conn->json.key) {
@@ -387,24 +1818,26 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 				/* Ignore units */
 				break;
 			case AQ_JKEY_REQUEST:
-				cp = &conn->json.request[0];
-				len = sizeof(conn->json.request);
+				cp = &op->request[0];
+				len = sizeof(op->request);
 				break;
 			case AQ_JKEY_NAME:
-				cp = &conn->json.name[0];
-				len = sizeof(conn->json.name);
+				free(op->name);
+				op->name = strdup(data);
 				break;
 			default:
 				err=-EINVAL;
 				break;
 		}
-		strncpy(cp, data, len - 1);
-		cp[len-1] = 0;
+		if (cp != NULL) {
+			strncpy(cp, data, len - 1);
+			cp[len-1] = 0;
+		}
 		break;
 	case JSON_TRUE:
 	case JSON_FALSE:
-		if (conn->json.depth == 1 && conn->json.key == AQ_JKEY_ACTIVE) {
-			conn->json.state = (type == JSON_TRUE) ? AQ_STATE_ON : AQ_STATE_OFF;
+		if (conn->json.key == AQ_JKEY_ACTIVE) {
+			op->state = (type == JSON_TRUE) ? AQ_STATE_ON : AQ_STATE_OFF;
 		}
 		break;
 	default:
@@ -429,7 +1862,7 @@ int aq_server_open(int port)
 	sin.sin_port = htons(port);
 	sin.sin_addr.s_addr = INADDR_ANY;
 
-	sock = socket(AF_INET, SOCK_STREAM, 0);
+	sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (sock < 0)
 		return sock;
 
@@ -441,7 +1874,40 @@ int aq_server_open(int port)
 		return err;
 	}
 
-	err = listen(sock, 128);
+	err = listen(sock, SOMAXCONN);
+	if (err < 0) {
+		close(sock);
+		return err;
+	}
+
+	return sock;
+}
+
+/* Listen on a UNIX stream socket, replacing any stale one
+ */
+int aq_server_open_unix(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int sock, err;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return sock;
+
+	unlink(path);
+	err = bind(sock, (const struct sockaddr *)&sun, sizeof(sun));
+	if (err < 0) {
+		close(sock);
+		return err;
+	}
+
+	err = listen(sock, SOMAXCONN);
 	if (err < 0) {
 		close(sock);
 		return err;
@@ -454,16 +1920,21 @@ struct aq_server_conn *aq_server_connect(struct aquaria *aq, int sock)
 {
 	struct aq_server_conn *conn;
 	int err, sfd;
-	struct sockaddr saddr;
+	struct sockaddr_storage saddr;
 	socklen_t slen = sizeof(saddr);
 
-	sfd = accept(sock, &saddr, &slen);
+	/* The connection is non-blocking, as it is
+	 * polled edge-triggered by the caller.
+	 */
+	sfd = accept4(sock, (struct sockaddr *)&saddr, &slen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (sfd < 0)
 		return NULL;
 
 	conn = calloc(1, sizeof(*conn));
-	if (conn == NULL)
+	if (conn == NULL) {
+		close(sfd);
 		return NULL;
+	}
 
 	conn->aq = aq;
 	conn->sock = sfd;
@@ -474,14 +1945,46 @@ struct aq_server_conn *aq_server_connect(struct aquaria *aq, int sock)
 	assert(err >= 0);
 
 	conn->json.depth = 0;
+	conn->json.op = &conn->json.req;
+
+	return conn;
+}
+
+/* Accept a connection that speaks HTTP/1.1
+ */
+struct aq_server_conn *aq_server_connect_http(struct aquaria *aq, int sock)
+{
+	struct aq_server_conn *conn;
+
+	conn = aq_server_connect(aq, sock);
+	if (conn != NULL)
+		conn->proto = AQ_SERVER_PROTO_HTTP;
 
 	return conn;
 }
 
 void aq_server_disconnect(struct aq_server_conn *conn)
 {
+	struct aq_server_conn **pconn;
+	int i;
+
+	if (conn->subscribed) {
+		for (pconn = &aq_server_subs; *pconn != conn; pconn = &(*pconn)->sub_next)
+			;
+		*pconn = conn->sub_next;
+	}
+
 	close(conn->sock);
 	json_parser_free(&conn->parser);
+	aq_server_json_reset(conn);
+	free(conn->json.ops);
+	free(conn->in.buf);
+	for (i = conn->out.head; i < conn->out.tail; i++) {
+		if (conn->out.seg[i].snap != NULL)
+			aq_server_snap_put(conn->out.seg[i].snap);
+		free(conn->out.seg[i].alloc);
+	}
+	free(conn->out.seg);
 	free(conn);
 }
 
@@ -490,21 +1993,143 @@ int aq_server_handle(struct aq_server_conn *conn)
 	int err, len;
 	char buff[PATH_MAX];
 
-	len = read(conn->sock, &buff[0], sizeof(buff));
-	if (len == 0) {
-		return -1;	/* EOF */
+	/* Drain the socket, as we are only told
+	 * about new data once.
+	 */
+	while (!conn->eof) {
+		len = read(conn->sock, &buff[0], sizeof(buff));
+		if (len == 0) {
+			conn->eof = 1;
+			break;
+		}
+
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len < 0)
+			return -errno;
+
+		/* JSON can't start with the binary protocol's magic */
+		if (conn->proto == AQ_SERVER_PROTO_NONE)
+			conn->proto = (buff[0] == AQ_PROTO_MAGIC[0]) ?
+			              AQ_SERVER_PROTO_MAGIC : AQ_SERVER_PROTO_JSON;
+
+		if (conn->proto == AQ_SERVER_PROTO_HTTP) {
+			err = aq_server_http_input(conn, buff, len);
+			if (err < 0)
+				return err;
+			continue;
+		}
+
+		if (conn->proto != AQ_SERVER_PROTO_JSON) {
+			err = aq_server_bin_input(conn, buff, len);
+			if (err < 0)
+				return err;
+			continue;
+		}
+
+		/* The JSON parser will call callbacks if need be.
+		 */
+		err = json_parser_string(&conn->parser, buff, len, NULL);
+		if (err)
+			return (conn->out.err < 0) ? conn->out.err : -EINVAL;
 	}
 
-	if (len < 0)
-		return len;
+	/* Don't send what is left of a cut off reply */
+	if (conn->out.err < 0)
+		return conn->out.err;
 
-	/* The JSON parser will call callbacks if need be.
-	 */
-	err = json_parser_string(&conn->parser, buff, len, NULL);
-	if (err)
-		return -EINVAL;
+	/* Send all the replies to what was read together */
+	return aq_server_flush(conn);
+}
 
-	return 0;
+/* Send as much of the pending output as the socket will take.
+ * Returns < 0 if the connection should be closed.
+ */
+int aq_server_flush(struct aq_server_conn *conn)
+{
+	struct iovec iov[AQ_SERVER_IOV];
+	struct msghdr msg = { .msg_iov = iov };
+	struct aq_server_seg *seg;
+	ssize_t len;
+	int i;
+
+	while (conn->out.head < conn->out.tail) {
+		for (i = 0; i < AQ_SERVER_IOV && conn->out.head + i < conn->out.tail; i++) {
+			seg = &conn->out.seg[conn->out.head + i];
+			iov[i].iov_base = (void *)seg->data;
+			iov[i].iov_len = seg->len;
+		}
+		msg.msg_iovlen = i;
+
+		len = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			return 0;	/* Resumed on EPOLLOUT */
+		if (len < 0)
+			return -errno;
+
+		/* Empty segments, such as the devices of a snapshot
+		 * without any, are used up as soon as they are reached.
+		 */
+		conn->out.len -= len;
+		while (conn->out.head < conn->out.tail) {
+			seg = &conn->out.seg[conn->out.head];
+			if (len < seg->len) {
+				seg->data += len;
+				seg->len -= len;
+				break;
+			}
+
+			len -= seg->len;
+			if (seg->snap != NULL)
+				aq_server_snap_put(seg->snap);
+			free(seg->alloc);
+			conn->out.head++;
+		}
+	}
+
+	/* All sent; reuse the segments for the next reply */
+	conn->out.head = 0;
+	conn->out.tail = 0;
+
+	/* Close once the peer has hung up, and has all its replies */
+	return conn->eof ? -1 : 0;
+}
+
+/* Push the changes to every subscriber.
+ * Call after the schedule has been evaluated.
+ */
+void aq_server_notify(struct aquaria *aq)
+{
+	struct aq_server_conn *conn, *next;
+	struct aq_server_snap *snap;
+	int err;
+
+	if (aq_server_subs == NULL)
+		return;
+
+	/* Subscribers catch up with the next change */
+	snap = aq_server_snapshot(aq);
+	if (snap == NULL)
+		return;
+
+	for (conn = aq_server_subs; conn != NULL; conn = next) {
+		next = conn->sub_next;
+		if (conn->aq != aq)
+			continue;
+
+		if (conn->proto == AQ_SERVER_PROTO_BINARY)
+			err = aq_server_bin_push(conn, snap);
+		else
+			err = aq_server_push(conn, snap);
+		if (err == 0)
+			err = aq_server_flush(conn);
+		if (err < 0)
+			aq_server_disconnect(conn);
+	}
 }
 
 int aq_server_socket(struct aq_server_conn *conn)
@@ -27,9 +27,13 @@
 struct aq_server_conn;
 
 int aq_server_open(int port);
+int aq_server_open_unix(const char *path);
 struct aq_server_conn *aq_server_connect(struct aquaria *aq, int listening_sock);
+struct aq_server_conn *aq_server_connect_http(struct aquaria *aq, int listening_sock);
 void aq_server_disconnect(struct aq_server_conn *conn);
 int aq_server_handle(struct aq_server_conn *conn);
+int aq_server_flush(struct aq_server_conn *conn);
+void aq_server_notify(struct aquaria *aq);
 int aq_server_socket(struct aq_server_conn *conn);
 
 #endif /* AQ_SERVER_H */
@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aquaria.h"
+#include "aq_shm.h"
+
+/* Segment layout: the header, the sensor records, the device
+ * records, then the names. Only the readings and device states
+ * change after the segment is created; they are guarded by a
+ * seqlock, so the daemon never waits for a reader.
+ */
+#define AQ_SHM_MAGIC	0x41515331	/* "AQS1" */
+
+/* Reads of a segment that stays mid-update this long fail */
+#define AQ_SHM_SPINS	(1 << 20)
+
+struct aq_shm_header {
+	uint32_t magic;
+	uint32_t size;		/* Of the whole segment */
+	uint32_t seq;		/* Odd while the records are being written */
+	uint32_t generation;	/* aq_generation() of the records */
+	uint32_t closed;	/* The daemon has let go of this segment */
+	uint32_t sensors;
+	uint32_t devices;
+	uint32_t reserved;
+};
+
+struct aq_shm_sensor {
+	uint64_t reading;
+	uint32_t late;
+	uint32_t missed;
+	int32_t type;
+	uint32_t name;		/* Offset in the segment */
+};
+
+struct aq_shm_device {
+	int64_t expire;		/* Override, or 0 */
+	int32_t state;
+	uint32_t name;		/* Offset in the segment */
+};
+
+struct aq_shm {
+	struct aq_shm_header *hdr;
+	struct aq_shm_sensor *sensor;
+	struct aq_shm_device *device;
+	size_t size;
+
+	/* Writer only */
+	struct aquaria *aq;
+	char *name;
+	struct aq_sensor **sensors;
+	struct aq_device **devices;
+};
+
+static void aq_shm_layout(struct aq_shm *shm)
+{
+	shm->sensor = (struct aq_shm_sensor *)(shm->hdr + 1);
+	shm->device = (struct aq_shm_device *)(shm->sensor + shm->hdr->sensors);
+}
+
+/* Mark a segment left by an earlier daemon closed
+ */
+static void aq_shm_retire(const char *name)
+{
+	struct aq_shm_header *hdr;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(*hdr)) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (hdr != MAP_FAILED) {
+			if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == AQ_SHM_MAGIC)
+				__atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+			munmap(hdr, sizeof(*hdr));
+		}
+	}
+	close(fd);
+}
+
+struct aq_shm *aq_shm_create(struct aquaria *aq, const char *name)
+{
+	struct aq_shm *shm;
+	struct aq_sensor *sen;
+	struct aq_device *dev;
+	size_t size, off;
+	int fd, i, sensors = 0, devices = 0;
+
+	size = sizeof(struct aq_shm_header);
+	for (sen = aq_sensors(aq); sen != NULL; sen = aq_sensor_next(sen)) {
+		size += sizeof(struct aq_shm_sensor) + strlen(aq_sensor_name(sen)) + 1;
+		sensors++;
+	}
+	for (dev = aq_devices(aq); dev != NULL; dev = aq_device_next(dev)) {
+		size += sizeof(struct aq_shm_device) + strlen(aq_device_name(dev)) + 1;
+		devices++;
+	}
+
+	/* Readers that still have an old segment open keep it.
+	 * It was marked closed if its daemon exited cleanly; if
+	 * not, do that now, so they know to open this one.
+	 */
+	aq_shm_retire(name);
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm = calloc(1, sizeof(*shm));
+	if (shm == NULL) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	shm->sensors = calloc(sensors ? sensors : 1, sizeof(*shm->sensors));
+	shm->devices = calloc(devices ? devices : 1, sizeof(*shm->devices));
+	shm->name = strdup(name);
+	shm->aq = aq;
+	shm->size = size;
+	if (shm->sensors == NULL || shm->devices == NULL || shm->name == NULL) {
+		close(fd);
+		shm_unlink(name);
+		aq_shm_destroy(shm);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	shm->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm->hdr == MAP_FAILED) {
+		shm->hdr = NULL;
+		aq_shm_destroy(shm);
+		return NULL;
+	}
+
+	shm->hdr->size = size;
+	shm->hdr->sensors = sensors;
+	shm->hdr->devices = devices;
+	aq_shm_layout(shm);
+
+	/* The names never change, so they go in once */
+	off = (char *)&shm->device[devices] - (char *)shm->hdr;
+	for (i = 0, sen = aq_sensors(aq); sen != NULL; sen = aq_sensor_next(sen), i++) {
+		shm->sensors[i] = sen;
+		shm->sensor[i].type = aq_sensor_type(sen);
+		shm->sensor[i].name = off;
+		strcpy((char *)shm->hdr + off, aq_sensor_name(sen));
+		off += strlen(aq_sensor_name(sen)) + 1;
+	}
+	for (i = 0, dev = aq_devices(aq); dev != NULL; dev = aq_device_next(dev), i++) {
+		shm->devices[i] = dev;
+		shm->device[i].name = off;
+		strcpy((char *)shm->hdr + off, aq_device_name(dev));
+		off += strlen(aq_device_name(dev)) + 1;
+	}
+
+	aq_shm_update(shm);
+
+	/* Readers check the magic last */
+	__atomic_store_n(&shm->hdr->magic, AQ_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return shm;
+}
+
+void aq_shm_update(struct aq_shm *shm)
+{
+	struct aq_shm_header *hdr = shm->hdr;
+	uint32_t seq = hdr->seq;
+	time_t override;
+	int i;
+
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < hdr->sensors; i++) {
+		shm->sensor[i].reading = aq_sensor_reading(shm->sensors[i]);
+		aq_sensor_stats(shm->sensors[i], &shm->sensor[i].late, &shm->sensor[i].missed);
+	}
+	for (i = 0; i < hdr->devices; i++) {
+		shm->device[i].state = aq_device_get(shm->devices[i], &override);
+		shm->device[i].expire = override;
+	}
+	hdr->generation = aq_generation(shm->aq);
+
+	__atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void aq_shm_destroy(struct aq_shm *shm)
+{
+	if (shm->hdr != NULL) {
+		__atomic_store_n(&shm->hdr->closed, 1, __ATOMIC_RELEASE);
+		munmap(shm->hdr, shm->size);
+	}
+	if (shm->name != NULL)
+		shm_unlink(shm->name);
+	free(shm->name);
+	free(shm->sensors);
+	free(shm->devices);
+	free(shm);
+}
+
+struct aq_shm *aq_shm_open(const char *name)
+{
+	struct aq_shm *shm;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct aq_shm_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	shm = calloc(1, sizeof(*shm));
+	if (shm == NULL) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	shm->hdr = map;
+	shm->size = st.st_size;
+
+	/* Not yet filled in, or not ours */
+	if (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != AQ_SHM_MAGIC ||
+	    shm->hdr->size != shm->size ||
+	    sizeof(*shm->hdr) + shm->hdr->sensors * sizeof(struct aq_shm_sensor) +
+	    shm->hdr->devices * sizeof(struct aq_shm_device) > shm->size ||
+	    ((char *)map)[shm->size - 1] != 0) {
+		aq_shm_close(shm);
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	aq_shm_layout(shm);
+
+	return shm;
+}
+
+void aq_shm_close(struct aq_shm *shm)
+{
+	munmap(shm->hdr, shm->size);
+	free(shm);
+}
+
+unsigned int aq_shm_generation(struct aq_shm *shm)
+{
+	return __atomic_load_n(&shm->hdr->generation, __ATOMIC_ACQUIRE);
+}
+
+int aq_shm_closed(struct aq_shm *shm)
+{
+	return __atomic_load_n(&shm->hdr->closed, __ATOMIC_ACQUIRE);
+}
+
+int aq_shm_sensors(struct aq_shm *shm)
+{
+	return shm->hdr->sensors;
+}
+
+int aq_shm_devices(struct aq_shm *shm)
+{
+	return shm->hdr->devices;
+}
+
+const char *aq_shm_sensor_name(struct aq_shm *shm, int id)
+{
+	if (id < 0 || id >= shm->hdr->sensors)
+		return NULL;
+
+	return (const char *)shm->hdr + shm->sensor[id].name;
+}
+
+const char *aq_shm_device_name(struct aq_shm *shm, int id)
+{
+	if (id < 0 || id >= shm->hdr->devices)
+		return NULL;
+
+	return (const char *)shm->hdr + shm->device[id].name;
+}
+
+int aq_shm_sensor_find(struct aq_shm *shm, const char *name)
+{
+	int i;
+
+	for (i = 0; i < shm->hdr->sensors; i++) {
+		if (strcmp(aq_shm_sensor_name(shm, i), name) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+int aq_shm_device_find(struct aq_shm *shm, const char *name)
+{
+	int i;
+
+	for (i = 0; i < shm->hdr->devices; i++) {
+		if (strcmp(aq_shm_device_name(shm, i), name) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/* Seqlock read side: retry until a copy was taken while the
+ * daemon was not writing. Give up on a daemon that died while
+ * it was.
+ */
+static int aq_shm_read_begin(struct aq_shm *shm, uint32_t *seq)
+{
+	int spins;
+
+	for (spins = 0; spins < AQ_SHM_SPINS; spins++) {
+		*seq = __atomic_load_n(&shm->hdr->seq, __ATOMIC_ACQUIRE);
+		if ((*seq & 1) == 0)
+			return 0;
+	}
+
+	return -EAGAIN;
+}
+
+static int aq_shm_read_retry(struct aq_shm *shm, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&shm->hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+int aq_shm_sensor_reading(struct aq_shm *shm, int id, uint64_t *reading)
+{
+	uint32_t seq;
+	uint64_t val;
+
+	if (id < 0 || id >= shm->hdr->sensors)
+		return -EINVAL;
+
+	do {
+		if (aq_shm_read_begin(shm, &seq) < 0)
+			return -EAGAIN;
+		val = shm->sensor[id].reading;
+	} while (aq_shm_read_retry(shm, seq));
+
+	*reading = val;
+
+	return aq_shm_closed(shm) ? -ESTALE : 0;
+}
+
+int aq_shm_device_state(struct aq_shm *shm, int id, enum aq_state *state, time_t *override)
+{
+	struct aq_shm_device dev;
+	uint32_t seq;
+
+	if (id < 0 || id >= shm->hdr->devices)
+		return -EINVAL;
+
+	do {
+		if (aq_shm_read_begin(shm, &seq) < 0)
+			return -EAGAIN;
+		dev = shm->device[id];
+	} while (aq_shm_read_retry(shm, seq));
+
+	*state = dev.state;
+	if (override != NULL)
+		*override = dev.expire;
+
+	return aq_shm_closed(shm) ? -ESTALE : 0;
+}
+
+int aq_shm_read(struct aq_shm *shm, uint64_t *readings, enum aq_state *states,
+                unsigned int *generation)
+{
+	uint32_t seq;
+	int i;
+
+	do {
+		if (aq_shm_read_begin(shm, &seq) < 0)
+			return -EAGAIN;
+		if (generation != NULL)
+			*generation = shm->hdr->generation;
+		for (i = 0; readings != NULL && i < shm->hdr->sensors; i++)
+			readings[i] = shm->sensor[i].reading;
+		for (i = 0; states != NULL && i < shm->hdr->devices; i++)
+			states[i] = shm->device[i].state;
+	} while (aq_shm_read_retry(shm, seq));
+
+	return aq_shm_closed(shm) ? -ESTALE : 0;
+}
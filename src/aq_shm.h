@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2010, Jason S. McMullan. All rights reserved.
+ * Author: Jason S. McMullan <jason.mcmullan@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef AQ_SHM_H
+#define AQ_SHM_H
+
+#include "aquaria.h"
+
+/* Writer side of the shared memory state segment. The reader
+ * side is in aquaria.h.
+ */
+struct aq_shm *aq_shm_create(struct aquaria *aq, const char *name);
+void aq_shm_update(struct aq_shm *shm);
+void aq_shm_destroy(struct aq_shm *shm);
+
+#endif /* AQ_SHM_H */
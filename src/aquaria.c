@@ -30,61 +30,161 @@
 #include <unistd.h>
 #include <poll.h>
 #include <limits.h>
+#include <stddef.h>
+#include <dlfcn.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 
 #include <netinet/in.h>
 
 #include <json.h>
 
 #include "aquaria.h"
+#include "aq_proto.h"
+#include "aq_shm.h"
+#include "aq_rollup.h"
 #include "log.h"
 #include "uthash.h"
 
+/* Default time between sensor readings
+ */
+#define AQ_SAMPLE_MS	1000
+
+/* Time before a device whose state change failed is tried again
+ */
+#define AQ_RETRY_MS	5000
+
+/* Most arguments a sensor or device program can be given
+ */
+#define AQ_ARGS_MAX	256
+
+/* Size of an arena chunk. Larger requests get a chunk of their own.
+ */
+#define AQ_ARENA_CHUNK	(16 * 1024)
+
+/* Objects that live as long as the struct aquaria (configuration,
+ * schedule, names) are carved out of these, and freed all at once.
+ */
+struct aq_arena {
+	struct aq_arena *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+/* Callback for a file descriptor in aq->epoll
+ */
+struct aq_watch {
+	void (*handle)(struct aq_watch *watch, uint32_t events);
+};
+
 struct aquaria {
 	struct {
 		int noop:1;
 	} flags;
 	struct log *log;
+	struct aq_arena *arena;		/* Configuration lifetime memory */
+	int epoll;			/* Outstanding program watches */
+	struct aq_actuator *busy;	/* Device programs in progress */
+	struct {
+		int deadline;		/* ms to wait for sensor readings */
+		int outstanding;	/* Sensor readings still expected */
+		int64_t until;		/* Deadline of the one in progress, or 0 */
+		unsigned int tick;	/* Current acquisition */
+		struct aq_sensor **due;	/* Min-heap, by sensor->due */
+		int dues;
+	} acquire;
+	/* NOTE: The fields used by aq_sched_eval() come first,
+	 *       so that they share the first cache line or two.
+	 */
 	struct aq_sensor {
-		void *log_id;
-		char name[PATH_MAX];
-		enum aq_sensor_type type;
 		uint64_t reading;
-
+		enum aq_sensor_type type;
+		int sample;		/* Due this tick */
+		int pending;		/* Waited on this tick */
+		int overdue;		/* Missed the last deadline */
 		int (*get_reading)(void *priv, uint64_t *reading);
 		void *priv;
 
+		/* Devices with conditions on this sensor */
+		struct aq_device **dependents;
+		int dependents_count;
+
+		unsigned int late;	/* Readings that missed a deadline */
+		unsigned int missed;	/* Deadlines without a reading */
+		int (*start_reading)(void *priv);
+		int64_t interval;	/* ms between readings, 0 = built-in */
+		int64_t due;		/* Next reading, in aq_sched_ms() */
+
+		const char *name;	/* In aq->strings */
+		void *log_id;
+		struct {
+			uint64_t reading;	/* Last one logged */
+			time_t time;		/* When, 0 if never */
+			uint64_t deadband;	/* Change to log, or ppm if relative */
+			int relative;
+			int keyframe;		/* Log at least every N seconds */
+		} logged;
 		UT_hash_handle hh;
 	} *sensors;
 	struct aq_device {
-		void *log_id;
-		char name[PATH_MAX];
-		int (*set_state)(void *priv, int is_on);
-		void *priv;
 		enum aq_state state;
 		struct {
 			enum aq_state state;
 			time_t expire;
 		} override;
 		struct aq_condition {
-			int id;
-			struct aq_sensor *sensor;	/* Name of the sensor */
-			enum aq_state state;
+			struct aq_sensor *sensor;
 			enum aq_operator operator;
+			enum aq_state state;
 			struct {
 				uint64_t reading;
 				uint64_t span;
 			} range;
 
+			int id;
 			UT_hash_handle hh;
 		} *conditions;
 
+		int dirty;			/* On aq->dirty */
+		struct aq_device *dirty_next;
+		int (*set_state)(void *priv, int is_on);
+		void *priv;
+		int status;			/* Result of the last state change */
+		unsigned int failures;		/* State changes that failed */
+		int retrying;			/* On aq->retries */
+		int64_t retry;			/* When, in aq_sched_ms() */
+		struct aq_device *retry_next;
+
+		int overridden;			/* On aq->overrides */
+		struct aq_device *override_next;
+
+		const char *name;		/* In aq->strings */
+		void *log_id;
 		struct aquaria *aq;
 		UT_hash_handle hh;
 	} *devices;
+	struct aq_string {
+		UT_hash_handle hh;
+		char str[];
+	} *strings;			/* Interned names */
+	unsigned int generation;	/* Bumped when the state changes */
+	struct aq_shm *shm;		/* Published state, if any */
+	struct aq_rollup *rollup;	/* Rollups of the readings, if any */
+	struct aq_device *dirty;	/* Devices needing evaluation */
+	struct aq_device *overrides;	/* Devices with unexpired overrides */
+	struct aq_device *retries;	/* Devices whose state change failed */
+	struct {
+		uint64_t *edge;		/* Sorted times of day (us) when a
+					 * Time condition can change */
+		int edges;
+		int midnight;		/* Time or Weekday conditions exist */
+	} clock;
 	struct aq_line {
 		int num;
 
@@ -97,9 +197,35 @@ struct aquaria {
 	struct {
 		json_parser parser;
 		json_printer print;
-		int sock;
-		struct sockaddr sockaddr;
+		int sock;		/* Kept open between requests */
+		int connecting;		/* Non-blocking connect() in progress */
+		struct sockaddr_storage sockaddr;	/* AF_INET or AF_UNIX */
 		socklen_t socklen;
+		struct {
+			char *buf;	/* Request being printed */
+			size_t size;
+			size_t len;
+		} out;
+
+		/* Requests, in the order their replies will arrive */
+		struct aq_request {
+			struct aq_request *next;
+			aq_done_fn done;
+			void *priv;
+			int retried;	/* Already resent after a lost connection */
+			int err;	/* Of the parsed reply */
+			struct aq_request *ops;	/* Completed along with a batch */
+			size_t sent;
+			size_t len;
+			char buf[];
+		} *request, **request_tail;
+
+		/* Operations collected since aq_batch_begin() */
+		struct {
+			int active;
+			int count;
+			struct aq_request *ops, **ops_tail;
+		} batch;
 
 		int depth;
 		int (*json_handler)(struct aquaria *aq, int type, const char *data, uint32_t len);
@@ -108,7 +234,6 @@ struct aquaria {
 			struct aq_device device;
 			struct aq_condition cond;
 		} tmp;
-		char units[PATH_MAX];
 		enum {
 			AQ_JSTATE_NONE = 0,
 			AQ_JSTATE_NAME,
@@ -119,12 +244,103 @@ struct aquaria {
 			AQ_JSTATE_CONDITION,
 			AQ_JSTATE_OPERATOR,
 			AQ_JSTATE_EXPIRE,
-			AQ_JSTATE_SPAN
+			AQ_JSTATE_SPAN,
+			AQ_JSTATE_LATE,
+			AQ_JSTATE_MISSED,
+			AQ_JSTATE_STATUS,
+			AQ_JSTATE_FAILURES
 		} state;
-		int done;
+		int done;		/* Replies parsed */
+		int empty;		/* Reply so far is "{}", a refusal */
+
+		/* Binary protocol */
+		int binary;
+		size_t hello;		/* Magic bytes sent */
+		int magic;		/* Magic echoed by the daemon */
+		struct {
+			char *buf;	/* Partial frame */
+			size_t size;
+			size_t len;
+		} in;
+		struct aq_sensor **sensor_id;	/* From the schema */
+		int sensor_ids;
+		struct aq_device **device_id;
+		int device_ids;
+
+		/* State pushed by the daemon, see aq_subscribe_start() */
+		struct {
+			int active;
+			aq_done_fn done;
+			void *priv;
+		} sub;
 	} client;
 };
 
+/* Zeroed memory that is freed along with the struct aquaria
+ */
+static void *aq_alloc(struct aquaria *aq, size_t size)
+{
+	struct aq_arena *arena = aq->arena;
+	void *ptr;
+
+	size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+	if (arena == NULL || arena->size - arena->used < size) {
+		size_t chunk = (size > AQ_ARENA_CHUNK) ? size : AQ_ARENA_CHUNK;
+
+		arena = calloc(1, sizeof(*arena) + chunk);
+		if (arena == NULL) {
+			syslog(LOG_ERR, "Out of memory");
+			exit(EX_OSERR);
+		}
+		arena->size = chunk;
+
+		/* Keep filling the current chunk if this one is
+		 * just for an oversized request.
+		 */
+		if (aq->arena != NULL && chunk > AQ_ARENA_CHUNK) {
+			arena->next = aq->arena->next;
+			aq->arena->next = arena;
+		} else {
+			arena->next = aq->arena;
+			aq->arena = arena;
+		}
+	}
+
+	ptr = (char *)arena->data + arena->used;
+	arena->used += size;
+
+	return ptr;
+}
+
+static char *aq_strdup(struct aquaria *aq, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(aq_alloc(aq, len), s, len);
+}
+
+/* Get the shared copy of a name
+ *
+ * This saves the copies, not the hashing: the sensor and device
+ * tables are still keyed by the name's contents, since lookups come
+ * with names off the wire that were never interned.
+ */
+static const char *aq_intern(struct aquaria *aq, const char *name)
+{
+	struct aq_string *str;
+	size_t len = strlen(name);
+
+	HASH_FIND(hh, aq->strings, name, len, str);
+	if (str == NULL) {
+		str = aq_alloc(aq, sizeof(*str) + len + 1);
+		memcpy(str->str, name, len + 1);
+		HASH_ADD_KEYPTR(hh, aq->strings, str->str, len, str);
+	}
+
+	return str->str;
+}
+
 /* Default sensors
  * Always - always 0
  * Time   - Time of day
@@ -162,11 +378,56 @@ static int get_reading_weekday(void *priv, uint64_t *reading)
 	return 1;
 }
 
+/* Min-heap of sensors, ordered by when their next reading is due
+ */
+static void aq_due_push(struct aquaria *aq, struct aq_sensor *sen)
+{
+	struct aq_sensor **heap;
+	int i;
+
+	heap = realloc(aq->acquire.due, sizeof(*heap) * (aq->acquire.dues + 1));
+	assert(heap != NULL);
+	aq->acquire.due = heap;
+
+	for (i = aq->acquire.dues++; i > 0; i = (i - 1) / 2) {
+		if (heap[(i - 1) / 2]->due <= sen->due)
+			break;
+		heap[i] = heap[(i - 1) / 2];
+	}
+	heap[i] = sen;
+}
+
+static struct aq_sensor *aq_due_pop(struct aquaria *aq)
+{
+	struct aq_sensor **heap = aq->acquire.due;
+	struct aq_sensor *sen, *last;
+	int i, child, n;
+
+	if (aq->acquire.dues == 0)
+		return NULL;
+
+	sen = heap[0];
+	n = --aq->acquire.dues;
+	last = heap[n];
+
+	for (i = 0; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n && heap[child + 1]->due < heap[child]->due)
+			child++;
+		if (last->due <= heap[child]->due)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+
+	return sen;
+}
+
 /* Add sensors to the schedule
  * This must be done before reading the schedule file!
  */
 static int aquaria_sensor(struct aquaria *aq, const char *name,
-                    enum aq_sensor_type type, int (*get_reading)(void *priv, uint64_t *reading),
+                    enum aq_sensor_type type, int (*start_reading)(void *priv),
+                    int (*get_reading)(void *priv, uint64_t *reading),
                     void *get_reading_priv)
 {
 	struct aq_sensor *sen;
@@ -176,10 +437,10 @@ static int aquaria_sensor(struct aquaria *aq, const char *name,
 		return -EBUSY;
 	}
 
-	sen = calloc(1, sizeof(*sen));
-	strncpy(sen->name, name, sizeof(sen->name));
-	sen->name[sizeof(sen->name)-1] = 0;
+	sen = aq_alloc(aq, sizeof(*sen));
+	sen->name = aq_intern(aq, name);
 	sen->type = type;
+	sen->start_reading = start_reading;
 	sen->get_reading = get_reading;
 	sen->priv = get_reading_priv;
 	if (type == AQ_SENSOR_NOP ||
@@ -190,11 +451,23 @@ static int aquaria_sensor(struct aquaria *aq, const char *name,
 		sen->log_id = log_register_sensor(aq->log, name, type);
 	}
 
-	HASH_ADD_STR(aq->sensors, name, sen);
+	HASH_ADD_KEYPTR(hh, aq->sensors, sen->name, strlen(sen->name), sen);
 
 	return 0;
 }
 
+/* Queue a device for evaluation
+ */
+static void aq_device_dirty(struct aq_device *dev)
+{
+	if (dev->dirty)
+		return;
+
+	dev->dirty = 1;
+	dev->dirty_next = dev->aq->dirty;
+	dev->aq->dirty = dev;
+}
+
 /* Add devices to the schedule
  * This must be done before reading the schedule file!
  */
@@ -209,16 +482,17 @@ static int aquaria_device(struct aquaria *aq, const char *name,
 		return -EBUSY;
 	}
 
-	dev = calloc(1, sizeof(*dev));
+	dev = aq_alloc(aq, sizeof(*dev));
 	dev->aq = aq;
-	strncpy(dev->name, name, sizeof(dev->name));
-	dev->name[sizeof(dev->name)-1] = 0;
+	dev->name = aq_intern(aq, name);
 	dev->state = AQ_STATE_UNCHANGED;
 	dev->set_state = set_state;
 	dev->priv = set_state_priv;
 	dev->log_id = log_register_device(aq->log, name);
 
-	HASH_ADD_STR(aq->devices, name, dev);
+	HASH_ADD_KEYPTR(hh, aq->devices, dev->name, strlen(dev->name), dev);
+
+	aq_device_dirty(dev);
 
 	return 0;
 }
@@ -238,10 +512,18 @@ struct aquaria *aq_create(const char *log, int noop)
 		return NULL;
 	}
 
+	aq->epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (aq->epoll < 0) {
+		log_close(aq->log);
+		free(aq);
+		return NULL;
+	}
+	aq->acquire.deadline = 800;
+
 	/* Predefined sensors */
-	aquaria_sensor(aq, "Always",  AQ_SENSOR_NOP,     get_reading_always, NULL);
-	aquaria_sensor(aq, "Time",    AQ_SENSOR_TIME,    get_reading_time,    &reading_time);
-	aquaria_sensor(aq, "Weekday", AQ_SENSOR_WEEKDAY, get_reading_weekday, &reading_time);
+	aquaria_sensor(aq, "Always",  AQ_SENSOR_NOP,     NULL, get_reading_always, NULL);
+	aquaria_sensor(aq, "Time",    AQ_SENSOR_TIME,    NULL, get_reading_time,    &reading_time);
+	aquaria_sensor(aq, "Weekday", AQ_SENSOR_WEEKDAY, NULL, get_reading_weekday, &reading_time);
 
 	return aq;
 }
@@ -275,18 +557,20 @@ static int rd_json_sensor(struct aquaria *aq, int type, const char *data, uint32
 	case JSON_OBJECT_END:
 		aq->client.depth--;
 		aq->client.state = AQ_JSTATE_NONE;
-		if (aq->client.depth != 2)
+		if (aq->client.depth != 2 || aq->client.tmp.sensor.name == NULL)
 			err = -EINVAL;
 		else {
 			struct aq_sensor *sen;
 
 			HASH_FIND_STR(aq->sensors, aq->client.tmp.sensor.name, sen);
 			if (sen == NULL) {
-				sen = malloc(sizeof(*sen));
+				sen = aq_alloc(aq, sizeof(*sen));
 				*sen = aq->client.tmp.sensor;
-				HASH_ADD_STR(aq->sensors, name, sen);
+				HASH_ADD_KEYPTR(hh, aq->sensors, sen->name, strlen(sen->name), sen);
 			} else if (sen->type == aq->client.tmp.sensor.type) {
 				sen->reading = aq->client.tmp.sensor.reading;
+				sen->late = aq->client.tmp.sensor.late;
+				sen->missed = aq->client.tmp.sensor.missed;
 			} else {
 				err = -EINVAL;
 			}
@@ -301,14 +585,17 @@ static int rd_json_sensor(struct aquaria *aq, int type, const char *data, uint32
 			aq->client.state = AQ_JSTATE_READING;
 		} else if (strcmp(data, "units") == 0) {
 			aq->client.state = AQ_JSTATE_UNITS;
+		} else if (strcmp(data, "late") == 0) {
+			aq->client.state = AQ_JSTATE_LATE;
+		} else if (strcmp(data, "missed") == 0) {
+			aq->client.state = AQ_JSTATE_MISSED;
 		} else {
 			err = -EINVAL;
 		}
 		break;
 	case JSON_STRING:
 		if (aq->client.state == AQ_JSTATE_NAME) {
-			strncpy(aq->client.tmp.sensor.name, data, sizeof(aq->client.tmp.sensor.name));
-			aq->client.tmp.sensor.name[sizeof(aq->client.tmp.sensor.name)-1] = 0;
+			aq->client.tmp.sensor.name = aq_intern(aq, data);
 		} else if (aq->client.state == AQ_JSTATE_UNITS) {
 			/* Ignored for now */
 		} else if (aq->client.state == AQ_JSTATE_TYPE) {
@@ -326,6 +613,10 @@ static int rd_json_sensor(struct aquaria *aq, int type, const char *data, uint32
 	case JSON_INT:
 		if (aq->client.state == AQ_JSTATE_READING) {
 			aq->client.tmp.sensor.reading = strtoull(data, NULL, 0);
+		} else if (aq->client.state == AQ_JSTATE_LATE) {
+			aq->client.tmp.sensor.late = strtoul(data, NULL, 0);
+		} else if (aq->client.state == AQ_JSTATE_MISSED) {
+			aq->client.tmp.sensor.missed = strtoul(data, NULL, 0);
 		} else {
 			err = -EINVAL;
 		}
@@ -441,13 +732,15 @@ static int rd_json_device(struct aquaria *aq, int type, const char *data, uint32
 
 			HASH_FIND_STR(aq->devices, aq->client.tmp.device.name, dev);
 			if (dev == NULL) {
-				dev = malloc(sizeof(*dev));
+				dev = aq_alloc(aq, sizeof(*dev));
 				*dev = aq->client.tmp.device;
 				dev->aq = aq;
-				HASH_ADD_STR(aq->devices, name, dev);
+				HASH_ADD_KEYPTR(hh, aq->devices, dev->name, strlen(dev->name), dev);
 			} else {
 				dev->state = aq->client.tmp.device.state;
 				dev->override = aq->client.tmp.device.override;
+				dev->status = aq->client.tmp.device.status;
+				dev->failures = aq->client.tmp.device.failures;
 			}
 		} else {
 			err = -EINVAL;
@@ -461,14 +754,26 @@ static int rd_json_device(struct aquaria *aq, int type, const char *data, uint32
 		} else if (strcmp(data, "override") == 0) {
 			aq->client.state = AQ_JSTATE_NONE;
 			aq->client.json_handler = rd_json_device_override;
+		} else if (strcmp(data, "status") == 0) {
+			aq->client.state = AQ_JSTATE_STATUS;
+		} else if (strcmp(data, "failures") == 0) {
+			aq->client.state = AQ_JSTATE_FAILURES;
 		} else {
 			err = -EINVAL;
 		}
 		break;
 	case JSON_STRING:
 		if (aq->client.state == AQ_JSTATE_NAME) {
-			strncpy(aq->client.tmp.device.name, data, sizeof(aq->client.tmp.device.name));
-			aq->client.tmp.device.name[sizeof(aq->client.tmp.device.name)-1] = 0;
+			aq->client.tmp.device.name = aq_intern(aq, data);
+		} else {
+			err = -EINVAL;
+		}
+		break;
+	case JSON_INT:
+		if (aq->client.state == AQ_JSTATE_STATUS) {
+			aq->client.tmp.device.status = strtol(data, NULL, 0);
+		} else if (aq->client.state == AQ_JSTATE_FAILURES) {
+			aq->client.tmp.device.failures = strtoul(data, NULL, 0);
 		} else {
 			err = -EINVAL;
 		}
@@ -488,6 +793,21 @@ static int rd_json_device(struct aquaria *aq, int type, const char *data, uint32
 	return err;
 }
 
+/* Note the outcome of the next request to be replied to. They are
+ * completed once the input has been parsed.
+ */
+static void aq_client_replied(struct aquaria *aq, int err)
+{
+	struct aq_request *req = aq->client.request;
+	int i;
+
+	for (i = 0; req != NULL && i < aq->client.done; i++)
+		req = req->next;
+	if (req != NULL)
+		req->err = err;
+	aq->client.done++;
+}
+
 static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 {
 	struct aquaria *aq = userdata;
@@ -501,13 +821,15 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 	else switch (type) {
 	case JSON_OBJECT_BEGIN:
 		aq->client.depth++;
+		aq->client.empty = 1;
 		break;
 	case JSON_OBJECT_END:
 		aq->client.depth--;
 		if (aq->client.depth == 0)
-			aq->client.done = 1;
+			aq_client_replied(aq, aq->client.empty ? -EINVAL : 0);
 		break;
 	case JSON_KEY:
+		aq->client.empty = 0;
 		if (strcmp(data, "sensor") == 0) {
 			aq->client.json_handler = rd_json_sensor;
 		} else if (strcmp(data, "device") == 0) {
@@ -532,192 +854,968 @@ static int rd_json(void *userdata, int type, const char *data, uint32_t len)
 static int wr_json(void *userdata, const char *s, uint32_t len)
 {
 	struct aquaria *aq = userdata;
-	int err;
+	size_t size;
+	char *buf;
 
-	err = write(aq->client.sock, s, len);
-	if (err < 0)
-		return err;
+	if (aq->client.out.len + len > aq->client.out.size) {
+		size = aq->client.out.size ? aq->client.out.size : 256;
+		while (size < aq->client.out.len + len)
+			size *= 2;
+
+		buf = realloc(aq->client.out.buf, size);
+		if (buf == NULL)
+			return -ENOMEM;
+
+		aq->client.out.buf = buf;
+		aq->client.out.size = size;
+	}
+
+	memcpy(&aq->client.out.buf[aq->client.out.len], s, len);
+	aq->client.out.len += len;
 
 	return 0;
 }
 
-int aq_sync(struct aquaria *aq, const char *request,const struct aq_device *dev)
+static void aq_client_close(struct aquaria *aq)
 {
-	json_printer *print;
-	int err;
-	time_t now;
-
-	if (aq->client.socklen == 0)
-		return 0;
+	if (aq->client.sock < 0)
+		return;
 
-	if (request == NULL) {
-		err = aq_sync(aq,  "get-sensor", NULL);
-		if (err < 0)
-			return err;
-		err = aq_sync(aq,  "get-device", NULL);
-		if (err < 0)
-			return err;
+	json_parser_free(&aq->client.parser);
+	close(aq->client.sock);
+	aq->client.sock = -1;
+	aq->client.connecting = 0;
+}
 
-		return 0;
-	}
+/* Start a non-blocking connection to the daemon
+ */
+static int aq_client_open(struct aquaria *aq)
+{
+	int err;
 
-	aq->client.sock = socket(aq->client.sockaddr.sa_family, SOCK_STREAM, 0);
+	aq->client.sock = socket(aq->client.sockaddr.ss_family,
+	                         SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (aq->client.sock < 0)
 		return -errno;
 
-	err = connect(aq->client.sock, &aq->client.sockaddr, aq->client.socklen);
+	err = json_parser_init(&aq->client.parser, NULL, rd_json, aq);
 	if (err < 0) {
-		err = -errno;
 		close(aq->client.sock);
 		aq->client.sock = -1;
-		return err;
+		return -ENOMEM;
 	}
 
-	err = json_parser_init(&aq->client.parser, NULL, rd_json, aq);
-	if (err < 0) {
+	aq->client.depth = 0;
+	aq->client.state = AQ_JSTATE_NONE;
+	aq->client.json_handler = NULL;
+	aq->client.done = 0;
+	aq->client.hello = 0;
+	aq->client.magic = 0;
+	aq->client.in.len = 0;
+
+	err = connect(aq->client.sock, (struct sockaddr *)&aq->client.sockaddr,
+	              aq->client.socklen);
+	if (err < 0 && errno == EINPROGRESS) {
+		aq->client.connecting = 1;
+	} else if (err < 0) {
 		err = -errno;
-		close(aq->client.sock);
+		aq_client_close(aq);
 		return err;
 	}
 
-	err = json_print_init(&aq->client.print, wr_json, aq);
-	if (err < 0) {
-		err = -errno;
-		json_parser_free(&aq->client.parser);
-		close(aq->client.sock);
-		return err;
+	return 0;
+}
+
+static void aq_request_complete(struct aquaria *aq, struct aq_request *req, int err)
+{
+	struct aq_request *op;
+
+	while ((op = req->ops) != NULL) {
+		req->ops = op->next;
+		aq_request_complete(aq, op, err);
 	}
 
-	print = &aq->client.print;
+	if (req->done != NULL)
+		req->done(aq, err, req->priv);
+	free(req);
+}
 
-	/* Request and parse */
-	json_print_pretty(print, JSON_OBJECT_BEGIN, NULL, 0);
-	json_print_pretty(print, JSON_KEY, "request", 7);
-	json_print_pretty(print, JSON_STRING, request, 10);
+/* Complete the oldest request
+ */
+static void aq_client_done(struct aquaria *aq, int err)
+{
+	struct aq_request *req = aq->client.request;
 
-	now = time(NULL);
-	if (dev != NULL) {
-		json_print_pretty(print, JSON_KEY, "name", 4);
-		json_print_pretty(print, JSON_STRING, dev->name, strlen(dev->name));
+	aq->client.request = req->next;
+	if (aq->client.request == NULL)
+		aq->client.request_tail = &aq->client.request;
 
-		if (dev->state != AQ_STATE_UNCHANGED &&
-		    dev->override.expire > now) {
-			char buff[256];
+	aq_request_complete(aq, req, err);
+}
 
-			json_print_pretty(print, JSON_KEY, "active", 6);
-			json_print_pretty(print, (dev->override.state==AQ_STATE_ON) ? JSON_TRUE : JSON_FALSE, NULL, 0);
-			json_print_pretty(print, JSON_KEY, "expire", 6);
-			snprintf(buff, sizeof(buff), "%" PRIu64, (uint64_t)(dev->override.expire - now));
-			buff[sizeof(buff)-1]=0;
-			json_print_pretty(print, JSON_INT, buff, strlen(buff));
-		}
-	}
+static int aq_request_frame(struct aquaria *aq, const char *request,
+                            const struct aq_device *dev);
+static struct aq_request *aq_request_new(struct aquaria *aq, aq_done_fn done, void *priv);
 
-	json_print_pretty(print, JSON_OBJECT_END, NULL, 0);
+/* The subscription request is done: the first state has
+ * arrived, or it failed
+ */
+static void aq_subscribe_done(struct aquaria *aq, int err, void *priv)
+{
+	if (err < 0)
+		aq->client.sub.active = 0;
 
-	json_print_free(&aq->client.print);
+	if (aq->client.sub.done != NULL)
+		aq->client.sub.done(aq, err, aq->client.sub.priv);
+}
 
-	/* Read till we can't read no more */
-	aq->client.done = 0;
-	do {
-		char buff;
+/* The daemon has stopped pushing its state
+ */
+static void aq_subscribe_end(struct aquaria *aq, int err)
+{
+	if (!aq->client.sub.active)
+		return;
 
-		do {
-			err = read(aq->client.sock, &buff, 1);
-			if (err < 0)
-				return err;
-		} while (err == 0);
+	aq_subscribe_done(aq, err, NULL);
+}
 
-		err = json_parser_string(&aq->client.parser, &buff, 1, NULL);
-		if (err < 0)
-			return err;
-	} while (!aq->client.done);
+/* Queue a subscription request for the next connection,
+ * unless one is already waiting
+ */
+static void aq_subscribe_again(struct aquaria *aq)
+{
+	struct aq_request *req;
 
-	json_parser_free(&aq->client.parser);
+	for (req = aq->client.request; req != NULL; req = req->next) {
+		if (req->done == aq_subscribe_done)
+			return;
+	}
 
-	close(aq->client.sock);
-	aq->client.sock = -1;
+	if (aq_request_frame(aq, "subscribe", NULL) < 0 ||
+	    (req = aq_request_new(aq, aq_subscribe_done, NULL)) == NULL) {
+		aq_subscribe_end(aq, -ENOMEM);
+		return;
+	}
 
-	return 0;
+	*aq->client.request_tail = req;
+	aq->client.request_tail = &req->next;
 }
 
-struct aquaria *aq_connect(const struct sockaddr *sin, socklen_t len)
+/* The connection failed. Requests sent on it are sent again on a
+ * new one, unless they have already been resent once. A
+ * subscription is made again on the new one.
+ */
+static int aq_client_lost(struct aquaria *aq, int err)
 {
-	int err;
-	struct aquaria *aq;
+	struct aq_request *req, **preq;
 
-	aq = calloc(1, sizeof(*aq));
-	aq->client.sockaddr = *sin;
-	aq->client.socklen = len;
+	aq_client_close(aq);
 
-	err = aq_sync(aq, NULL, NULL);
+	for (preq = &aq->client.request; (req = *preq) != NULL; ) {
+		if (req->sent > 0 && req->retried) {
+			*preq = req->next;
+			if (*preq == NULL)
+				aq->client.request_tail = preq;
+			aq_request_complete(aq, req, err);
+			continue;
+		}
+
+		if (req->sent > 0)
+			req->retried = 1;
+		req->sent = 0;
+		preq = &req->next;
+	}
+
+	if (aq->client.sub.active)
+		aq_subscribe_again(aq);
+
+	if (aq->client.request == NULL)
+		return err;
+
+	err = aq_client_open(aq);
 	if (err < 0) {
-		aq_free(aq);
-		return NULL;
+		/* Can't reach the daemon at all */
+		while (aq->client.request != NULL)
+			aq_client_done(aq, err);
 	}
 
-	return aq;
+	return err;
 }
 
-void aq_free(struct aquaria *aq)
+/* Send as much of buf as the socket takes
+ */
+static int aq_client_send(struct aquaria *aq, const char *buf, size_t *sent, size_t len)
 {
-	struct aq_sensor *sen;
-	struct aq_device *dev;
-	struct aq_line *line;
-
-	if (aq->client.sock >= 0) {
-		json_print_free(&aq->client.print);
-		json_parser_free(&aq->client.parser);
-		close(aq->client.sock);
-	}
+	ssize_t n;
 
-	while (aq->lines) {
-		line = aq->lines;
-		HASH_DEL(aq->lines, line);
-		free(line->line);
-		free(line);
+	while (*sent < len) {
+		n = send(aq->client.sock, &buf[*sent], len - *sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0)
+			return -errno;
+		*sent += n;
 	}
 
-	while (aq->devices) {
-		struct aq_condition *cond;
-
-		dev = aq->devices;
-		HASH_DEL(aq->devices, dev);
+	return 0;
+}
 
-		while (dev->conditions) {
-			cond = dev->conditions;
-			HASH_DEL(dev->conditions, cond);
-			free(cond);
-		}
+/* Learn the sensor and device ids from a SCHEMA frame
+ */
+static int aq_client_schema(struct aquaria *aq, const uint8_t *data, uint32_t len)
+{
+	const uint8_t *end = data + len;
+	struct aq_sensor *sen, **sensor_id;
+	struct aq_device *dev, **device_id;
+	char name[256];
+	int i, n, type;
 
-		free(dev);
+	if (end - data < 2)
+		return -EINVAL;
+	n = aq_get_le16(data);
+	data += 2;
+
+	sensor_id = realloc(aq->client.sensor_id, (n ? n : 1) * sizeof(*sensor_id));
+	if (sensor_id == NULL)
+		return -ENOMEM;
+	aq->client.sensor_id = sensor_id;
+	aq->client.sensor_ids = 0;
+
+	for (i = 0; i < n; i++) {
+		if (end - data < 2 || end - data < 2 + data[1])
+			return -EINVAL;
+		type = data[0];
+		memcpy(name, &data[2], data[1]);
+		name[data[1]] = 0;
+		data += 2 + data[1];
+
+		HASH_FIND_STR(aq->sensors, name, sen);
+		if (sen == NULL) {
+			sen = aq_alloc(aq, sizeof(*sen));
+			sen->name = aq_intern(aq, name);
+			sen->type = type;
+			HASH_ADD_KEYPTR(hh, aq->sensors, sen->name, strlen(sen->name), sen);
+		} else if (sen->type != type) {
+			return -EINVAL;
+		}
+		sensor_id[aq->client.sensor_ids++] = sen;
 	}
 
-	while (aq->sensors) {
-		sen = aq->sensors;
-		HASH_DEL(aq->sensors, sen);
-		free(sen);
+	if (end - data < 2)
+		return -EINVAL;
+	n = aq_get_le16(data);
+	data += 2;
+
+	device_id = realloc(aq->client.device_id, (n ? n : 1) * sizeof(*device_id));
+	if (device_id == NULL)
+		return -ENOMEM;
+	aq->client.device_id = device_id;
+	aq->client.device_ids = 0;
+
+	for (i = 0; i < n; i++) {
+		if (end - data < 1 || end - data < 1 + data[0])
+			return -EINVAL;
+		memcpy(name, &data[1], data[0]);
+		name[data[0]] = 0;
+		data += 1 + data[0];
+
+		HASH_FIND_STR(aq->devices, name, dev);
+		if (dev == NULL) {
+			dev = aq_alloc(aq, sizeof(*dev));
+			dev->name = aq_intern(aq, name);
+			dev->state = AQ_STATE_UNCHANGED;
+			dev->aq = aq;
+			HASH_ADD_KEYPTR(hh, aq->devices, dev->name, strlen(dev->name), dev);
+		}
+		device_id[aq->client.device_ids++] = dev;
 	}
 
-	free(aq);
+	return 0;
 }
 
-struct aq_sensor *aq_sensor_find(struct aquaria *aq, const char *name)
+/* Apply a STATE frame
+ */
+static int aq_client_state(struct aquaria *aq, const uint8_t *data, uint32_t len)
 {
 	struct aq_sensor *sen;
+	struct aq_device *dev;
+	uint32_t expire;
+	size_t need = 1;
+	int i, mask;
 
-	HASH_FIND_STR(aq->sensors, name, sen);
+	if (len < 1)
+		return -EINVAL;
 
-	return sen;
-}
+	mask = *data++;
+	if (mask & AQ_FRAME_SENSORS)
+		need += aq->client.sensor_ids * AQ_FRAME_SENSOR_LEN;
+	if (mask & AQ_FRAME_DEVICES)
+		need += aq->client.device_ids * AQ_FRAME_DEVICE_LEN;
+	if (len != need)
+		return -EINVAL;
 
-struct aq_device *aq_device_find(struct aquaria *aq, const char *name)
-{
-	struct aq_device *dev;
+	if (mask & AQ_FRAME_SENSORS) {
+		for (i = 0; i < aq->client.sensor_ids; i++, data += AQ_FRAME_SENSOR_LEN) {
+			sen = aq->client.sensor_id[i];
+			sen->reading = aq_get_le64(&data[0]);
+			sen->late = aq_get_le32(&data[8]);
+			sen->missed = aq_get_le32(&data[12]);
+		}
+	}
 
-	HASH_FIND_STR(aq->devices, name, dev);
+	if (mask & AQ_FRAME_DEVICES) {
+		for (i = 0; i < aq->client.device_ids; i++, data += AQ_FRAME_DEVICE_LEN) {
+			dev = aq->client.device_id[i];
+			dev->state = (data[0] == AQ_FRAME_STATE_NONE) ? AQ_STATE_UNCHANGED : data[0];
+			expire = aq_get_le32(&data[2]);
+			dev->override.state = expire ? data[1] : AQ_STATE_OFF;
+			dev->override.expire = expire ? time(NULL) + expire : 0;
+		}
+	}
 
-	return dev;
+	return 0;
+}
+
+/* Take in binary protocol input, and handle the whole frames
+ */
+static int aq_client_input(struct aquaria *aq, const char *data, size_t len)
+{
+	const uint8_t *frame;
+	size_t off = 0;
+	uint32_t flen;
+	char *buf;
+	int err = 0;
+
+	if (aq->client.in.len + len > aq->client.in.size) {
+		size_t size = aq->client.in.size ? aq->client.in.size : 4096;
+
+		while (size < aq->client.in.len + len)
+			size *= 2;
+		buf = realloc(aq->client.in.buf, size);
+		if (buf == NULL)
+			return -ENOMEM;
+		aq->client.in.buf = buf;
+		aq->client.in.size = size;
+	}
+	memcpy(&aq->client.in.buf[aq->client.in.len], data, len);
+	aq->client.in.len += len;
+
+	if (!aq->client.magic) {
+		if (aq->client.in.len < AQ_PROTO_MAGIC_LEN)
+			return 0;
+		if (memcmp(aq->client.in.buf, AQ_PROTO_MAGIC, AQ_PROTO_MAGIC_LEN) != 0)
+			return -EINVAL;
+		aq->client.magic = 1;
+		off = AQ_PROTO_MAGIC_LEN;
+	}
+
+	while (err == 0 && aq->client.in.len - off >= AQ_FRAME_HEADER) {
+		frame = (const uint8_t *)&aq->client.in.buf[off];
+		flen = aq_get_le32(frame);
+		if (flen < 1 || flen > AQ_FRAME_MAX)
+			return -EINVAL;
+		if (aq->client.in.len - off - 4 < flen)
+			break;
+
+		switch (frame[4]) {
+		case AQ_FRAME_SCHEMA:
+			err = aq_client_schema(aq, &frame[AQ_FRAME_HEADER], flen - 1);
+			break;
+		case AQ_FRAME_STATE:
+			err = aq_client_state(aq, &frame[AQ_FRAME_HEADER], flen - 1);
+			if (err == 0)
+				aq_client_replied(aq, 0);
+			break;
+		case AQ_FRAME_ERROR:
+			aq_client_replied(aq, -EINVAL);
+			break;
+		case AQ_FRAME_UPDATE:
+			/* Pushed, not a reply */
+			err = aq_client_state(aq, &frame[AQ_FRAME_HEADER], flen - 1);
+			break;
+		default:
+			err = -EINVAL;
+			break;
+		}
+
+		off += 4 + flen;
+	}
+
+	memmove(aq->client.in.buf, &aq->client.in.buf[off], aq->client.in.len - off);
+	aq->client.in.len -= off;
+
+	return err;
+}
+
+int aq_binary(struct aquaria *aq)
+{
+	if (aq->client.request != NULL || aq->client.batch.active)
+		return -EBUSY;
+
+	/* The next request reconnects */
+	aq_client_close(aq);
+	aq->client.binary = 1;
+
+	return 0;
+}
+
+int aq_fd(struct aquaria *aq)
+{
+	return aq->client.sock;
+}
+
+short aq_events(struct aquaria *aq)
+{
+	struct aq_request *req;
+
+	if (aq->client.sock < 0 ||
+	    (aq->client.request == NULL && !aq->client.sub.active))
+		return 0;
+
+	if (aq->client.connecting)
+		return POLLOUT;
+
+	for (req = aq->client.request; req != NULL; req = req->next) {
+		if (req->sent < req->len)
+			return POLLIN | POLLOUT;
+	}
+
+	return POLLIN;
+}
+
+int aq_process(struct aquaria *aq)
+{
+	struct aq_request *req;
+	char buff[4096];
+	ssize_t len;
+	int err;
+
+	if (aq->client.sock < 0)
+		return 0;
+
+	if (aq->client.connecting) {
+		struct pollfd pfd = { .fd = aq->client.sock, .events = POLLOUT };
+		socklen_t elen = sizeof(err);
+
+		if (poll(&pfd, 1, 0) == 0)
+			return 0;
+
+		getsockopt(aq->client.sock, SOL_SOCKET, SO_ERROR, &err, &elen);
+		if (err != 0) {
+			/* Nothing was sent, so there is no point in retrying */
+			aq_client_close(aq);
+			while (aq->client.request != NULL)
+				aq_client_done(aq, -err);
+			aq_subscribe_end(aq, -err);
+			return -err;
+		}
+		aq->client.connecting = 0;
+	}
+
+	/* Send what we can, after the binary protocol's magic */
+	err = 0;
+	if (aq->client.binary)
+		err = aq_client_send(aq, AQ_PROTO_MAGIC, &aq->client.hello, AQ_PROTO_MAGIC_LEN);
+	if (aq->client.binary && aq->client.hello < AQ_PROTO_MAGIC_LEN)
+		req = NULL;
+	else
+		req = aq->client.request;
+	for (; err == 0 && req != NULL; req = req->next) {
+		err = aq_client_send(aq, req->buf, &req->sent, req->len);
+		if (req->sent < req->len)
+			break;
+	}
+	if (err < 0)
+		return aq_client_lost(aq, err);
+
+	/* Parse what has arrived, and complete the replied to requests */
+	while (aq->client.request != NULL || aq->client.sub.active) {
+		len = read(aq->client.sock, buff, sizeof(buff));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && errno == EAGAIN)
+			break;
+		if (len < 0)
+			return aq_client_lost(aq, -errno);
+		if (len == 0)
+			return aq_client_lost(aq, -EPIPE);
+
+		if (aq->client.binary)
+			err = aq_client_input(aq, buff, len);
+		else
+			err = json_parser_string(&aq->client.parser, buff, len, NULL);
+		if (err) {
+			/* Out of step with the daemon; start over */
+			aq_client_close(aq);
+			while (aq->client.request != NULL)
+				aq_client_done(aq, -EINVAL);
+			aq_subscribe_end(aq, -EINVAL);
+			return -EINVAL;
+		}
+
+		for (; aq->client.done > 0 && aq->client.request != NULL; aq->client.done--)
+			aq_client_done(aq, aq->client.request->err);
+	}
+
+	return 0;
+}
+
+struct aq_sync_wait {
+	int done;
+	int err;
+};
+
+static void aq_sync_done(struct aquaria *aq, int err, void *priv)
+{
+	struct aq_sync_wait *wait = priv;
+
+	wait->done = 1;
+	wait->err = err;
+}
+
+/* Run the connection until a blocking call's request is done
+ */
+static int aq_sync_wait(struct aquaria *aq, struct aq_sync_wait *wait)
+{
+	struct pollfd pfd;
+
+	while (!wait->done) {
+		pfd.fd = aq_fd(aq);
+		pfd.events = aq_events(aq);
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+		aq_process(aq);
+	}
+
+	return wait->err;
+}
+
+/* Copy the request printed in aq->client.out
+ */
+static struct aq_request *aq_request_new(struct aquaria *aq, aq_done_fn done, void *priv)
+{
+	struct aq_request *req;
+
+	req = calloc(1, sizeof(*req) + aq->client.out.len);
+	if (req == NULL)
+		return NULL;
+
+	req->done = done;
+	req->priv = priv;
+	req->len = aq->client.out.len;
+	memcpy(req->buf, aq->client.out.buf, req->len);
+
+	return req;
+}
+
+static int aq_request_send(struct aquaria *aq, struct aq_request *req);
+
+/* Print a JSON request into aq->client.out
+ */
+static int aq_request_print(struct aquaria *aq, const char *request,
+                            const struct aq_device *dev)
+{
+	json_printer *print;
+	time_t now;
+	int err;
+
+	aq->client.out.len = 0;
+	err = json_print_init(&aq->client.print, wr_json, aq);
+	if (err < 0)
+		return -ENOMEM;
+
+	print = &aq->client.print;
+
+	json_print_pretty(print, JSON_OBJECT_BEGIN, NULL, 0);
+	json_print_pretty(print, JSON_KEY, "request", 7);
+	json_print_pretty(print, JSON_STRING, request, strlen(request));
+
+	now = time(NULL);
+	if (dev != NULL) {
+		json_print_pretty(print, JSON_KEY, "name", 4);
+		json_print_pretty(print, JSON_STRING, dev->name, strlen(dev->name));
+
+		if (dev->state != AQ_STATE_UNCHANGED &&
+		    dev->override.expire > now) {
+			char buff[256];
+
+			json_print_pretty(print, JSON_KEY, "active", 6);
+			json_print_pretty(print, (dev->override.state==AQ_STATE_ON) ? JSON_TRUE : JSON_FALSE, NULL, 0);
+			json_print_pretty(print, JSON_KEY, "expire", 6);
+			snprintf(buff, sizeof(buff), "%" PRIu64, (uint64_t)(dev->override.expire - now));
+			buff[sizeof(buff)-1]=0;
+			json_print_pretty(print, JSON_INT, buff, strlen(buff));
+		}
+	}
+
+	json_print_pretty(print, JSON_OBJECT_END, NULL, 0);
+
+	json_print_free(&aq->client.print);
+
+	return 0;
+}
+
+/* Frame a binary request into aq->client.out. A NULL request
+ * gets both sensors and devices.
+ */
+static int aq_request_frame(struct aquaria *aq, const char *request,
+                            const struct aq_device *dev)
+{
+	uint8_t frame[AQ_FRAME_HEADER + AQ_FRAME_SET_LEN];
+	time_t now;
+	int i;
+
+	if (request == NULL || strcmp(request, "get-sensor") == 0 ||
+	                       strcmp(request, "get-device") == 0) {
+		aq_put_le32(frame, 2);
+		frame[4] = AQ_FRAME_GET;
+		frame[5] = 0;
+		if (request == NULL || strcmp(request, "get-sensor") == 0)
+			frame[5] |= AQ_FRAME_SENSORS;
+		if (request == NULL || strcmp(request, "get-device") == 0)
+			frame[5] |= AQ_FRAME_DEVICES;
+	} else if (strcmp(request, "subscribe") == 0) {
+		aq_put_le32(frame, 1);
+		frame[4] = AQ_FRAME_SUBSCRIBE;
+	} else if (strcmp(request, "set-device") == 0 && dev != NULL) {
+		/* Devices are known by their id in the schema */
+		for (i = 0; i < aq->client.device_ids; i++) {
+			if (aq->client.device_id[i] == dev)
+				break;
+		}
+		if (i == aq->client.device_ids)
+			return -ENOENT;
+
+		now = time(NULL);
+		aq_put_le32(frame, 1 + AQ_FRAME_SET_LEN);
+		frame[4] = AQ_FRAME_SET;
+		aq_put_le16(&frame[5], i);
+		frame[7] = (dev->override.state == AQ_STATE_ON);
+		aq_put_le32(&frame[8], 0);
+		if (dev->override.expire > now)
+			aq_put_le32(&frame[8], dev->override.expire - now);
+	} else {
+		return -EINVAL;
+	}
+
+	aq->client.out.len = 0;
+	return wr_json(aq, (const char *)frame, aq_get_le32(frame) + 4);
+}
+
+/* Print a request, and queue it
+ */
+static int aq_request_start(struct aquaria *aq, const char *request,
+                            const struct aq_device *dev,
+                            aq_done_fn done, void *priv)
+{
+	struct aq_request *req;
+	int err;
+
+	if (aq->client.socklen == 0)
+		return -EINVAL;
+
+	if (aq->client.binary)
+		err = aq_request_frame(aq, request, dev);
+	else
+		err = aq_request_print(aq, request, dev);
+	if (err < 0)
+		return err;
+
+	req = aq_request_new(aq, done, priv);
+	if (req == NULL)
+		return -ENOMEM;
+
+	/* Hold device changes back for aq_batch_commit() */
+	if (aq->client.batch.active && request != NULL &&
+	    strcmp(request, "set-device") == 0) {
+		*aq->client.batch.ops_tail = req;
+		aq->client.batch.ops_tail = &req->next;
+		aq->client.batch.count++;
+		return 0;
+	}
+
+	return aq_request_send(aq, req);
+}
+
+int aq_batch_begin(struct aquaria *aq)
+{
+	if (aq->client.batch.active)
+		return -EBUSY;
+
+	aq->client.batch.active = 1;
+	aq->client.batch.count = 0;
+	aq->client.batch.ops = NULL;
+	aq->client.batch.ops_tail = &aq->client.batch.ops;
+
+	return 0;
+}
+
+int aq_batch_commit_start(struct aquaria *aq, aq_done_fn done, void *priv)
+{
+	struct aq_request *req, *op;
+	static const char begin[] = "{\"request\":\"batch\",\"ops\":[";
+
+	if (!aq->client.batch.active)
+		return -EINVAL;
+
+	aq->client.batch.active = 0;
+
+	/* Nothing to send, or nowhere to send it */
+	if (aq->client.batch.count == 0 || aq->client.socklen == 0) {
+		req = calloc(1, sizeof(*req));
+		if (req == NULL)
+			return -ENOMEM;
+		req->done = done;
+		req->priv = priv;
+		req->ops = aq->client.batch.ops;
+		aq_request_complete(aq, req, 0);
+		return 0;
+	}
+
+	aq->client.out.len = 0;
+	if (aq->client.binary) {
+		/* The payloads of the SET frames, in one BATCH frame */
+		uint8_t header[AQ_FRAME_HEADER];
+
+		aq_put_le32(header, 1 + aq->client.batch.count * AQ_FRAME_SET_LEN);
+		header[4] = AQ_FRAME_BATCH;
+		wr_json(aq, (const char *)header, AQ_FRAME_HEADER);
+		for (op = aq->client.batch.ops; op != NULL; op = op->next)
+			wr_json(aq, &op->buf[AQ_FRAME_HEADER], AQ_FRAME_SET_LEN);
+	} else {
+		wr_json(aq, begin, strlen(begin));
+		for (op = aq->client.batch.ops; op != NULL; op = op->next) {
+			if (op != aq->client.batch.ops)
+				wr_json(aq, ",", 1);
+			wr_json(aq, op->buf, op->len);
+		}
+		wr_json(aq, "]}", 2);
+	}
+
+	req = aq_request_new(aq, done, priv);
+	if (req == NULL) {
+		req = aq->client.batch.ops;
+		aq->client.batch.ops = NULL;
+		while ((op = req) != NULL) {
+			req = op->next;
+			aq_request_complete(aq, op, -ENOMEM);
+		}
+		return -ENOMEM;
+	}
+
+	/* The operations complete with the batch */
+	req->ops = aq->client.batch.ops;
+	aq->client.batch.ops = NULL;
+
+	return aq_request_send(aq, req);
+}
+
+int aq_batch_commit(struct aquaria *aq)
+{
+	struct aq_sync_wait wait = { .done = 0, .err = 0 };
+	int err;
+
+	err = aq_batch_commit_start(aq, aq_sync_done, &wait);
+	if (err < 0)
+		return err;
+
+	return aq_sync_wait(aq, &wait);
+}
+
+/* Queue a request, and start sending it
+ */
+static int aq_request_send(struct aquaria *aq, struct aq_request *req)
+{
+	int err;
+
+	*aq->client.request_tail = req;
+	aq->client.request_tail = &req->next;
+
+	if (aq->client.sock < 0) {
+		err = aq_client_open(aq);
+		if (err < 0) {
+			while (aq->client.request != NULL)
+				aq_client_done(aq, err);
+			return err;
+		}
+	}
+
+	aq_process(aq);
+
+	return 0;
+}
+
+int aq_sync_start(struct aquaria *aq, aq_done_fn done, void *priv)
+{
+	int err;
+
+	if (aq->client.binary)
+		return aq_request_start(aq, NULL, NULL, done, priv);
+
+	/* Replies come in order, so the second one finishes the sync */
+	err = aq_request_start(aq, "get-sensor", NULL, NULL, NULL);
+	if (err < 0)
+		return err;
+
+	return aq_request_start(aq, "get-device", NULL, done, priv);
+}
+
+int aq_subscribe_start(struct aquaria *aq, aq_done_fn done, void *priv)
+{
+	int err;
+
+	if (!aq->client.binary)
+		return -EOPNOTSUPP;
+
+	if (aq->client.sub.active)
+		return -EBUSY;
+
+	aq->client.sub.active = 1;
+	aq->client.sub.done = done;
+	aq->client.sub.priv = priv;
+
+	err = aq_request_start(aq, "subscribe", NULL, aq_subscribe_done, NULL);
+	if (err < 0)
+		aq->client.sub.active = 0;
+
+	return err;
+}
+
+int aq_sync(struct aquaria *aq, const char *request,const struct aq_device *dev)
+{
+	struct aq_sync_wait wait = { .done = 0, .err = 0 };
+	int err;
+
+	if (aq->client.socklen == 0)
+		return 0;
+
+	/* Nothing to wait for until the batch is committed */
+	if (aq->client.batch.active && request != NULL &&
+	    strcmp(request, "set-device") == 0)
+		return aq_request_start(aq, request, dev, NULL, NULL);
+
+	if (request == NULL)
+		err = aq_sync_start(aq, aq_sync_done, &wait);
+	else
+		err = aq_request_start(aq, request, dev, aq_sync_done, &wait);
+	if (err < 0)
+		return err;
+
+	return aq_sync_wait(aq, &wait);
+}
+
+struct aquaria *aq_connect_async(const struct sockaddr *sin, socklen_t len)
+{
+	struct aquaria *aq;
+
+	if (len > sizeof(aq->client.sockaddr)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	aq = calloc(1, sizeof(*aq));
+	if (aq == NULL)
+		return NULL;
+
+	aq->epoll = -1;
+	aq->client.sock = -1;
+	memcpy(&aq->client.sockaddr, sin, len);
+	aq->client.socklen = len;
+	aq->client.request_tail = &aq->client.request;
+
+	return aq;
+}
+
+struct aquaria *aq_connect(const struct sockaddr *sin, socklen_t len)
+{
+	int err;
+	struct aquaria *aq;
+
+	aq = aq_connect_async(sin, len);
+	if (aq == NULL)
+		return NULL;
+
+	err = aq_sync(aq, NULL, NULL);
+	if (err < 0) {
+		aq_free(aq);
+		return NULL;
+	}
+
+	return aq;
+}
+
+void aq_free(struct aquaria *aq)
+{
+	struct aq_sensor *sen;
+	struct aq_device *dev;
+	struct aq_arena *arena;
+	struct aq_request *req;
+
+	if (aq->shm != NULL)
+		aq_shm_destroy(aq->shm);
+	if (aq->rollup != NULL)
+		aq_rollup_destroy(aq->rollup);
+	if (aq->log != NULL)
+		log_close(aq->log);
+
+	aq_client_close(aq);
+	while (aq->client.request != NULL)
+		aq_client_done(aq, -ECANCELED);
+	while ((req = aq->client.batch.ops) != NULL) {
+		aq->client.batch.ops = req->next;
+		aq_request_complete(aq, req, -ECANCELED);
+	}
+	free(aq->client.out.buf);
+	free(aq->client.in.buf);
+	free(aq->client.sensor_id);
+	free(aq->client.device_id);
+
+	if (aq->epoll >= 0)
+		close(aq->epoll);
+
+	free(aq->acquire.due);
+	free(aq->clock.edge);
+
+	/* The objects themselves are in the arena,
+	 * only the hash tables and growable arrays are not.
+	 */
+	for (dev = aq->devices; dev != NULL; dev = dev->hh.next)
+		HASH_CLEAR(hh, dev->conditions);
+
+	for (sen = aq->sensors; sen != NULL; sen = sen->hh.next)
+		free(sen->dependents);
+
+	HASH_CLEAR(hh, aq->lines);
+	HASH_CLEAR(hh, aq->devices);
+	HASH_CLEAR(hh, aq->sensors);
+	HASH_CLEAR(hh, aq->strings);
+
+	while ((arena = aq->arena) != NULL) {
+		aq->arena = arena->next;
+		free(arena);
+	}
+
+	free(aq);
+}
+
+struct aq_sensor *aq_sensor_find(struct aquaria *aq, const char *name)
+{
+	struct aq_sensor *sen;
+
+	HASH_FIND_STR(aq->sensors, name, sen);
+
+	return sen;
+}
+
+struct aq_device *aq_device_find(struct aquaria *aq, const char *name)
+{
+	struct aq_device *dev;
+
+	HASH_FIND_STR(aq->devices, name, dev);
+
+	return dev;
 }
 
 const char *aq_sensor_typename(enum aq_sensor_type type)
@@ -774,37 +1872,261 @@ enum aq_sensor_type aq_sensor_nametype(const char *name)
 	return type;
 }
 
-static int aq_device_exec(void *priv, int is_on)
+/* CLOCK_MONOTONIC, in ms
+ */
+static int64_t aq_sched_ms(void)
 {
-	char **argv = priv;
-	char buff[256];
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Evaluate a device again once AQ_RETRY_MS has passed, as
+ * its inputs may not change again for some time.
+ */
+static void aq_device_retry(struct aq_device *dev)
+{
+	dev->retry = aq_sched_ms() + AQ_RETRY_MS;
+	if (dev->retrying)
+		return;
+
+	dev->retrying = 1;
+	dev->retry_next = dev->aq->retries;
+	dev->aq->retries = dev;
+}
+
+/* Asynchronous device program
+ *
+ * Only one program per device runs at a time. State changes
+ * requested while it runs are queued, and only the most
+ * recent one is applied when it finishes.
+ */
+struct aq_actuator {
+	struct aq_watch watch;	// stderr
+	struct aq_watch exit;	// pidfd
+	struct aquaria *aq;
+	char **argv;
+	int timeout;		// Seconds to wait for the program
 	pid_t pid;
-	int status;
+	int fd;			// stderr of the program, or -1
+	int pidfd;		// Readable when it exits, or -1
+	int64_t expire;		// CLOCK_MONOTONIC ms
+	int is_on;		// State being applied
+	int pending;		// State to apply next, or -1
+	struct aq_device *dev;	// Whose state this applies
+	char error[256];	// Last line of error
+	int error_len;
+	struct aq_actuator *next;	// On aq->busy
+};
+
+/* A descriptor that becomes readable when 'pid' exits,
+ * or -1 if the kernel is too old to give us one.
+ */
+static int aq_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+static int aq_actuator_start(struct aq_actuator *act, int is_on)
+{
+	struct epoll_event ev;
+	int pfd_stderr[2];
+	pid_t pid;
+	int err;
+
+	err = pipe2(pfd_stderr, O_CLOEXEC);
+	if (err < 0)
+		return -errno;
 
 	/* NOTE: argv[0] is already set to the program to run,
 	 *       argv[1] is NULL,
 	 *       argv[N] has the arguments passed in from the config file
 	 */
-	snprintf(buff, sizeof(buff), "--state=%s", is_on ? "on" : "off");
-	argv[1] = buff;
+	act->argv[1] = is_on ? "--state=on" : "--state=off";
 
 	pid = fork();
-	if (pid == 0) { /* child */
-		execvp(argv[0], argv);
+	if (pid < 0) {
+		err = -errno;
+		close(pfd_stderr[0]);
+		close(pfd_stderr[1]);
+		return err;
+	} else if (pid == 0) { /* child */
+		dup2(pfd_stderr[1], 2);
+		execvp(act->argv[0], act->argv);
 		exit(EX_UNAVAILABLE);
 	}
 
-	/* parent - wait for child to die */
-	while (waitpid(pid, &status, 0) == 1) {
-		if (WIFEXITED(status))
+	close(pfd_stderr[1]);
+	fcntl(pfd_stderr[0], F_SETFL, O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &act->watch;
+	epoll_ctl(act->aq->epoll, EPOLL_CTL_ADD, pfd_stderr[0], &ev);
+
+	act->pidfd = aq_pidfd(pid);
+	if (act->pidfd >= 0) {
+		ev.data.ptr = &act->exit;
+		epoll_ctl(act->aq->epoll, EPOLL_CTL_ADD, act->pidfd, &ev);
+	}
+
+	act->fd = pfd_stderr[0];
+	act->pid = pid;
+	act->is_on = is_on;
+	act->expire = aq_sched_ms() + act->timeout * 1000LL;
+	act->error_len = 0;
+
+	act->next = act->aq->busy;
+	act->aq->busy = act;
+
+	return 0;
+}
+
+/* Collect the program's error output
+ * Returns 0 on EOF, < 0 on error or no more data
+ */
+static int aq_actuator_read(struct aq_actuator *act)
+{
+	int len;
+
+	do {
+		if (act->error_len >= sizeof(act->error) - 1)
+			act->error_len = 0;
+		len = read(act->fd, &act->error[act->error_len],
+		           sizeof(act->error) - 1 - act->error_len);
+		if (len > 0)
+			act->error_len += len;
+	} while (len > 0);
+
+	return len;
+}
+
+static void aq_actuator_close(struct aq_actuator *act)
+{
+	if (act->fd < 0)
+		return;
+
+	aq_actuator_read(act);
+
+	epoll_ctl(act->aq->epoll, EPOLL_CTL_DEL, act->fd, NULL);
+	close(act->fd);
+	act->fd = -1;
+}
+
+/* Record the result of the program, and start the next one.
+ */
+static void aq_actuator_done(struct aq_actuator *act, int status)
+{
+	struct aq_actuator **pact;
+
+	aq_actuator_close(act);
+	if (act->pidfd >= 0) {
+		epoll_ctl(act->aq->epoll, EPOLL_CTL_DEL, act->pidfd, NULL);
+		close(act->pidfd);
+		act->pidfd = -1;
+	}
+	act->pid = 0;
+	act->dev->status = status;
+	act->aq->generation++;
+
+	if (status != 0) {
+		act->dev->failures++;
+		while (act->error_len > 0 && act->error[act->error_len - 1] == '\n')
+			act->error_len--;
+		act->error[act->error_len] = 0;
+		syslog(LOG_ERR, "%s --state=%s: failed (%d) %s", act->argv[0],
+		       act->is_on ? "on" : "off", status, act->error);
+
+		/* Unless superseded, the device is in neither state */
+		if (act->pending < 0) {
+			act->dev->state = AQ_STATE_UNCHANGED;
+			aq_device_retry(act->dev);
+		}
+	}
+
+	for (pact = &act->aq->busy; *pact != NULL; pact = &(*pact)->next) {
+		if (*pact == act) {
+			*pact = act->next;
 			break;
+		}
+	}
 
-		if (WIFSIGNALED(status)) {
-			return -EX_SOFTWARE;
+	if (act->pending >= 0) {
+		int is_on = act->pending;
+
+		act->pending = -1;
+		status = aq_actuator_start(act, is_on);
+		if (status < 0) {
+			act->dev->failures++;
+			act->dev->status = status;
+			act->dev->state = AQ_STATE_UNCHANGED;
+			act->aq->generation++;
+			aq_device_retry(act->dev);
 		}
 	}
+}
 
-	return -WEXITSTATUS(status);
+/* Reap the program if it has exited, or kill it if it
+ * has run too long.
+ */
+static void aq_actuator_check(struct aq_actuator *act, int64_t now)
+{
+	int status;
+
+	if (act->pid <= 0)
+		return;
+
+	if (waitpid(act->pid, &status, WNOHANG) == act->pid) {
+		if (WIFSIGNALED(status))
+			aq_actuator_done(act, -EX_SOFTWARE);
+		else
+			aq_actuator_done(act, -WEXITSTATUS(status));
+	} else if (now >= act->expire) {
+		kill(act->pid, SIGKILL);
+		waitpid(act->pid, &status, 0);
+		aq_actuator_done(act, -ETIMEDOUT);
+	}
+}
+
+static void aq_actuator_handle(struct aq_watch *watch, uint32_t events)
+{
+	struct aq_actuator *act = (struct aq_actuator *)watch;
+	int len;
+
+	len = aq_actuator_read(act);
+	if (len == 0 || (len < 0 && errno != EAGAIN)) {
+		/* Program has closed stderr, and is likely exiting.
+		 * Without a pidfd, this is the best time to look.
+		 */
+		aq_actuator_close(act);
+		if (act->pidfd < 0)
+			aq_actuator_check(act, aq_sched_ms());
+	}
+}
+
+static void aq_actuator_exited(struct aq_watch *watch, uint32_t events)
+{
+	struct aq_actuator *act;
+
+	act = (struct aq_actuator *)((char *)watch - offsetof(struct aq_actuator, exit));
+
+	aq_actuator_check(act, aq_sched_ms());
+}
+
+static int aq_device_exec(void *priv, int is_on)
+{
+	struct aq_actuator *act = priv;
+
+	if (act->pid > 0) {
+		act->pending = is_on;
+		return 0;
+	}
+
+	return aq_actuator_start(act, is_on);
 }
 
 static int aq_device_debug(void *priv, int is_on)
@@ -829,46 +2151,82 @@ static int aq_device_debug(void *priv, int is_on)
 	return 0;
 }
 
+/* Sensor program
+ *
+ * The program's stdout and stderr are watched in aq->epoll,
+ * and readings are collected as they arrive.
+ */
 struct aq_process {
+	struct aq_watch out;	// stdout
+	struct aq_watch err;	// stderr
+	struct aquaria *aq;
 	char * const *argv;
+	int stream;		// Program stays running, one reading per line
 	pid_t pid;
-	struct pollfd pollfd[2];	// 1 = stdout, 2 = stderr
+	int fd[2];		// 0 = stdout, 1 = stderr
+	int fresh;		// proc->line has an unused reading
+	unsigned int waiting;	// Acquisition tick waiting on a reading
 	char input[256];	// We only want one line of input
 	int input_len;
 	char error[256];	// and only one line of error
 	int error_len;
+	char line[256];		// Last complete line of input
 };
 
+static void aquaria_exec_stdout(struct aq_watch *watch, uint32_t events);
+static void aquaria_exec_stderr(struct aq_watch *watch, uint32_t events);
+
+static struct aq_process *aquaria_process(struct aquaria *aq)
+{
+	struct aq_process *proc;
+
+	proc = aq_alloc(aq, sizeof(*proc));
+	proc->out.handle = aquaria_exec_stdout;
+	proc->err.handle = aquaria_exec_stderr;
+	proc->aq = aq;
+	proc->fd[0] = -1;
+	proc->fd[1] = -1;
+
+	return proc;
+}
+
 static int aquaria_exec(struct aq_process *proc)
 {
 	char * const *argv = proc->argv;
+	struct epoll_event ev;
 	pid_t pid;
 	int pfd_stdout[2];
 	int pfd_stderr[2];
 	int err;
-	struct pollfd *pollfd = &proc->pollfd[0];
 
 	proc->pid = 0;
 	proc->input_len = 0;
 	proc->error_len = 0;
 
-	err = pipe(pfd_stdout);
-	assert(err >= 0);
-	err = pipe(pfd_stderr);
-	assert(err >= 0);
+	err = pipe2(pfd_stdout, O_CLOEXEC);
+	if (err < 0)
+		return -errno;
+	err = pipe2(pfd_stderr, O_CLOEXEC);
+	if (err < 0) {
+		err = -errno;
+		close(pfd_stdout[0]);
+		close(pfd_stdout[1]);
+		return err;
+	}
 
 	/* NOTE: argv[0] is already set to the program to run,
 	 *       argv[N] has the arguments passed in from the config file
 	 */
 	pid = fork();
 	if (pid < 0) {
+		err = -errno;
+		close(pfd_stdout[0]);
 		close(pfd_stdout[1]);
+		close(pfd_stderr[0]);
 		close(pfd_stderr[1]);
-		return -1;
+		return err;
 	} else if (pid == 0) { /* child */
-		close(pfd_stdout[0]);
 		dup2(pfd_stdout[1], 1);
-		close(pfd_stderr[0]);
 		dup2(pfd_stderr[1], 2);
 		execvp(argv[0], argv);
 		exit(EX_UNAVAILABLE);
@@ -877,132 +2235,285 @@ static int aquaria_exec(struct aq_process *proc)
 	close(pfd_stdout[1]);
 	close(pfd_stderr[1]);
 
-	pollfd[0].fd = pfd_stdout[0];
-	pollfd[0].events = POLLIN | POLLERR | POLLHUP;
-	pollfd[0].revents = 0;
-	pollfd[1].fd = pfd_stderr[0];
-	pollfd[1].events = POLLIN | POLLERR | POLLHUP;
-	pollfd[1].revents = 0;
+	proc->fd[0] = pfd_stdout[0];
+	proc->fd[1] = pfd_stderr[0];
+	fcntl(proc->fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(proc->fd[1], F_SETFL, O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &proc->out;
+	epoll_ctl(proc->aq->epoll, EPOLL_CTL_ADD, proc->fd[0], &ev);
+	ev.data.ptr = &proc->err;
+	epoll_ctl(proc->aq->epoll, EPOLL_CTL_ADD, proc->fd[1], &ev);
 
 	proc->pid = pid;
 
 	return 0;
 }
 
-/* Returns 0 for ok, 1 for valid input line, < 0 for closed pipe
+static void aquaria_exec_close(struct aq_process *proc, int i)
+{
+	if (proc->fd[i] < 0)
+		return;
+
+	epoll_ctl(proc->aq->epoll, EPOLL_CTL_DEL, proc->fd[i], NULL);
+	close(proc->fd[i]);
+	proc->fd[i] = -1;
+}
+
+/* Stop waiting for a reading from this program
+ */
+static void aquaria_exec_done(struct aq_process *proc)
+{
+	if (proc->waiting == proc->aq->acquire.tick)
+		proc->aq->acquire.outstanding--;
+
+	proc->waiting = 0;
+}
+
+/* Wait for the child to die
  */
-static int aquaria_exec_handler(struct aq_process *proc)
+static void aquaria_exec_stop(struct aq_process *proc)
 {
-	char *cp, *ecp;
-	struct pollfd *pollfd = &proc->pollfd[0];
 	int status;
-	int got_input = 0;
-	int got_error = 0;
-	int err = 0;
+
+	aquaria_exec_close(proc, 0);
+	aquaria_exec_close(proc, 1);
+
+	if (proc->pid > 0) {
+		kill(proc->pid, SIGTERM);
+		waitpid(proc->pid, &status, 0);
+		proc->pid = 0;
+	}
+
+	aquaria_exec_done(proc);
+}
+
+/* Move the last complete line of input to proc->line, and
+ * keep any trailing partial line for the next read.
+ */
+static void aquaria_exec_line(struct aq_process *proc)
+{
+	char *eol, *bol;
 	int len;
 
-	cp = &proc->input[proc->input_len];
-	ecp = &proc->error[proc->error_len];
+	eol = memrchr(proc->input, '\n', proc->input_len);
+	assert(eol != NULL);
+	*eol = 0;
 
-	err = poll(proc->pollfd, 2, 0);
-	if (err == 0)
-		return 0;
+	bol = memrchr(proc->input, '\n', eol - proc->input);
+	bol = (bol == NULL) ? proc->input : (bol + 1);
+
+	strcpy(proc->line, bol);
+
+	len = proc->input_len - (eol + 1 - proc->input);
+	memmove(proc->input, eol + 1, len);
+	proc->input_len = len;
+	proc->input[len] = 0;
+}
 
-	if ((err > 0) && pollfd[0].revents & POLLIN) {
-		len = read(pollfd[0].fd, cp, sizeof(proc->input) - (cp - proc->input));
+static void aquaria_exec_stdout(struct aq_watch *watch, uint32_t events)
+{
+	struct aq_process *proc = (struct aq_process *)watch;
+	int got_input = 0;
+	char *cp;
+	int len;
+
+	do {
+		/* A streaming sensor that filled its buffer without
+		 * a newline is sending garbage. Drop it.
+		 */
+		if (proc->input_len >= sizeof(proc->input) - 1)
+			proc->input_len = 0;
+
+		cp = &proc->input[proc->input_len];
+		len = read(proc->fd[0], cp, sizeof(proc->input) - 1 - proc->input_len);
 		if (len > 0) {
 			cp[len] = 0;
-			if (strchr(cp, '\n') != NULL)
+			if (memchr(cp, '\n', len) != NULL)
 				got_input = 1;
-			cp += len;
 			proc->input_len += len;
-		} else {
-			err = -errno;
 		}
+	} while (len > 0);
+
+	if (got_input) {
+		aquaria_exec_line(proc);
+		proc->fresh = 1;
+		aquaria_exec_done(proc);
 	}
 
-	if ((err > 0) && pollfd[1].revents & POLLIN) {
-		len = read(pollfd[1].fd, ecp, sizeof(proc->error) - (ecp - proc->error));
+	/* Streaming sensors are left running until their pipe closes.
+	 */
+	if ((len == 0 || (len < 0 && errno != EAGAIN)) ||
+	    (!proc->stream && got_input))
+		aquaria_exec_stop(proc);
+}
+
+static void aquaria_exec_stderr(struct aq_watch *watch, uint32_t events)
+{
+	struct aq_process *proc;
+	char *ecp, *eol;
+	int len;
+
+	proc = (struct aq_process *)((char *)watch - offsetof(struct aq_process, err));
+
+	do {
+		if (proc->error_len >= sizeof(proc->error) - 1)
+			proc->error_len = 0;
+
+		ecp = &proc->error[proc->error_len];
+		len = read(proc->fd[1], ecp, sizeof(proc->error) - 1 - proc->error_len);
 		if (len > 0) {
 			ecp[len] = 0;
-			if (strchr(ecp, '\n') != NULL)
-				got_error = 1;
-			ecp += len;
 			proc->error_len += len;
-		} else {
-			err = -errno;
 		}
+
+		eol = memrchr(proc->error, '\n', proc->error_len);
+		if (eol != NULL) {
+			*eol = 0;
+			syslog(LOG_ERR, "%s: %s", proc->argv[0], proc->error);
+			proc->error_len = 0;
+		}
+	} while (len > 0);
+
+	if (len == 0 || (len < 0 && errno != EAGAIN))
+		aquaria_exec_close(proc, 1);
+}
+
+/* Start a reading, if needed.
+ * Returns 1 if the caller should wait for the reading.
+ */
+static int aquaria_sensor_start(void *priv)
+{
+	struct aq_process *proc = priv;
+	int err;
+
+	if (proc->fresh)
+		return 0;
+
+	if (proc->pid <= 0) {
+		err = aquaria_exec(proc);
+		if (err < 0)
+			return err;
 	}
 
-	if ((err > 0) &&
-	    ((pollfd[0].revents & (POLLERR | POLLHUP)) ||
-	     (pollfd[1].revents & (POLLERR | POLLHUP)))) {
-		err = -EPIPE;
-	}
+	/* Streaming sensors deliver readings at their own pace */
+	if (proc->stream)
+		return 0;
+
+	proc->waiting = proc->aq->acquire.tick;
+	return 1;
+}
+
+static int aquaria_sensor_exec(void *priv, uint64_t *reading)
+{
+	struct aq_process *proc = priv;
+	char *cp;
+	uint64_t val;
+
+	if (!proc->fresh)
+		return 0;
+
+	proc->fresh = 0;
+
+	val = strtoull(proc->line, &cp, 0);
+	if (cp == proc->line)
+		return -EIO;
+
+	*reading = val;
+	return 1;
+}
+
+/* Is this program a driver plugin?
+ */
+static int aquaria_is_plugin(const char *program)
+{
+	size_t len = strlen(program);
+
+	return (len > 3 && strcmp(&program[len - 3], ".so") == 0);
+}
+
+/* Load a driver plugin, and return its 'symbol' callback.
+ *
+ * NOTE: argv[0] is the plugin to load,
+ *       argv[N] has the arguments passed in from the config file
+ *
+ * If the plugin exports driver_open(), its return value is
+ * the callback's private data. Otherwise, argv is.
+ */
+static void *aquaria_plugin(char **argv, const char *symbol, void **priv)
+{
+	void *dl, *func;
+	void *(*driver_open)(int argc, char **argv);
+	int argc;
 
-	if (err > 0)
-		err = 0;
+	dl = dlopen(argv[0], RTLD_NOW | RTLD_LOCAL);
+	if (dl == NULL) {
+		syslog(LOG_ERR, "%s", dlerror());
+		return NULL;
+	}
 
-	if (got_error) {
-		*ecp = 0;
-		syslog(LOG_ERR, "%s: %s", proc->argv[0], proc->error);
-		err = 0;
+	func = dlsym(dl, symbol);
+	if (func == NULL) {
+		syslog(LOG_ERR, "%s: No '%s' callback exported", argv[0], symbol);
+		dlclose(dl);
+		return NULL;
 	}
 
-	if (got_input)
-		err = 1;
+	for (argc = 0; argv[argc] != NULL; argc++);
 
-	/* wait for child to die */
-	if (err != 0) {
-		close(pollfd[0].fd);
-		close(pollfd[1].fd);
-		kill(proc->pid, SIGTERM);
-		waitpid(proc->pid, &status, 0);
-		proc->pid = 0;
+	*priv = argv;
+	driver_open = dlsym(dl, "driver_open");
+	if (driver_open != NULL) {
+		*priv = driver_open(argc, argv);
+		if (*priv == NULL) {
+			syslog(LOG_ERR, "%s: driver_open() failed", argv[0]);
+			dlclose(dl);
+			return NULL;
+		}
 	}
 
-	return err;
+	return func;
 }
 
-static int aquaria_sensor_exec(void *priv, uint64_t *reading)
+/* Get the next token. If it is an 'attr=value' token,
+ * *val is set to the value, otherwise *val is NULL.
+ */
+static char *read_attr(char **s, char **val)
 {
-	struct aq_process *proc = priv;
-	int err;
-
-	if (proc->pid <= 0) {
-		err = aquaria_exec(proc);
-		if (err < 0)
-			return err;
-		err = 0;
-	}
-
-	if (proc->pid > 0)
-		err = aquaria_exec_handler(proc);
-
-	if (err == 1) {
-		char *cp;
-		uint64_t val;
+	char *tok;
 
-		val = strtoull(proc->input, &cp, 0);
-		if (cp == proc->input)
-			err = -EIO;
-		else	
-			*reading = val;
+	*val = NULL;
+	tok = strtok_r(NULL, " \t,", s);
+	if (tok != NULL) {
+		*val = strchr(tok, '=');
+		if (*val != NULL)
+			*((*val)++) = 0;
 	}
 
-	return err;
+	return tok;
 }
 
-static char **read_args(int argc, char **argv, char **s)
+/* Collect the rest of the line after the first argc
+ * entries of args, and copy them all to a NULL terminated
+ * argv. Returns NULL if there are too many arguments.
+ */
+static char **read_args(struct aquaria *aq, char **args, int argc, char **s)
 {
-	char *tok;
+	char **argv, *tok;
+	int i;
 
 	while ((tok = strtok_r(NULL, " \t,", s)) != NULL) {
-		argv[argc++] = strdup(tok);
-		argv = realloc(argv, (argc+1) * sizeof(char *));
-		argv[argc] = NULL;
+		if (argc == AQ_ARGS_MAX)
+			return NULL;
+		args[argc++] = tok;
 	}
 
+	argv = aq_alloc(aq, (argc+1) * sizeof(char *));
+	for (i = 0; i < argc; i++)
+		argv[i] = (args[i] == NULL) ? NULL : aq_strdup(aq, args[i]);
+	argv[argc] = NULL;
+
 	return argv;
 }
 
@@ -1012,6 +2523,7 @@ int aq_config_read(struct aquaria *aq, const char *file)
 {
 	FILE *inf;
 	char buff[1024+1], *s, *tok;
+	char *args[AQ_ARGS_MAX];
 	int lineno = 0;
 	int err;
 
@@ -1053,6 +2565,12 @@ int aq_config_read(struct aquaria *aq, const char *file)
 			struct aq_device *dev;
 			char **argv;
 			const char *dev_name;
+			struct aq_actuator *act = NULL;
+			int (*set_state)(void *priv, int is_on);
+			void *priv;
+			int i;
+			char *val, *cp;
+			int timeout = 10;	/* Default program timeout */
 
 			/* Get device name */
 			tok = strtok_r(NULL, " \t,", &s);
@@ -1068,37 +2586,98 @@ int aq_config_read(struct aquaria *aq, const char *file)
 				       file, lineno, tok);
 				exit(EX_DATAERR);
 			}
+			if (strlen(tok) > AQ_FRAME_NAME_MAX) {
+				syslog(LOG_ERR, "%s:%d: Device name '%s' too long (> %d characters)",
+				       file, lineno, tok, AQ_FRAME_NAME_MAX);
+				exit(EX_DATAERR);
+			}
 			dev_name = tok;
 
-			/* Get device program name */
-			tok = strtok_r(NULL, " \t,", &s);
+			/* Get device attributes, then the program name */
+			while ((tok = read_attr(&s, &val)) != NULL && val != NULL) {
+				if (strcasecmp(tok, "timeout") == 0) {
+					timeout = strtol(val, &cp, 0);
+					if (cp == val || *cp != 0 || timeout <= 0) {
+						syslog(LOG_ERR, "%s:%d: Invalid device timeout '%s'",
+						       file, lineno, val);
+						exit(EX_DATAERR);
+					}
+				} else {
+					syslog(LOG_ERR, "%s:%d: Unrecognized device attribute '%s=%s'",
+					       file, lineno, tok, val);
+					exit(EX_DATAERR);
+				}
+			}
+
 			if (tok == NULL) {
 				syslog(LOG_ERR, "%s:%d: No device program given",
 				       file, lineno);
 				exit(EX_DATAERR);
 			}
 
-			argv = malloc(sizeof(char *)*3);
-			argv[0] = strdup(tok);
-			argv[1] = NULL;		/* For the --state= option */
-			argv[2] = NULL;		/* Tail end */
+			args[0] = tok;
+			args[1] = NULL;		/* For the --state= option */
 
 			/* Read in arguments */
-			argv = read_args(2, argv, &s);
+			argv = read_args(aq, args, 2, &s);
+			if (argv == NULL) {
+				syslog(LOG_ERR, "%s:%d: Too many device arguments (> %d)",
+				       file, lineno, AQ_ARGS_MAX);
+				exit(EX_DATAERR);
+			}
 
-			err = aquaria_device(aq, dev_name, aq->flags.noop ? aq_device_debug : aq_device_exec, argv);
+			if (aq->flags.noop) {
+				set_state = aq_device_debug;
+				priv = argv;
+			} else if (aquaria_is_plugin(argv[0])) {
+				/* Plugins don't need the --state= slot */
+				for (i = 2; argv[i] != NULL; i++)
+					argv[i - 1] = argv[i];
+				argv[i - 1] = NULL;
+
+				set_state = aquaria_plugin(argv, "set_state", &priv);
+				if (set_state == NULL) {
+					syslog(LOG_ERR, "%s:%d: Cannot load device plugin '%s'", file, lineno, argv[0]);
+					exit(EX_DATAERR);
+				}
+			} else {
+				act = aq_alloc(aq, sizeof(*act));
+				act->watch.handle = aq_actuator_handle;
+				act->exit.handle = aq_actuator_exited;
+				act->aq = aq;
+				act->argv = argv;
+				act->timeout = timeout;
+				act->fd = -1;
+				act->pidfd = -1;
+				act->pending = -1;
+
+				set_state = aq_device_exec;
+				priv = act;
+			}
+
+			err = aquaria_device(aq, dev_name, set_state, priv);
 			if (err < 0) {
 				syslog(LOG_ERR, "%s:%d: Cannot create device '%s'", file, lineno, argv[0]);
 				exit(EX_DATAERR);
 			}
+			if (act != NULL)
+				act->dev = aq_device_find(aq, dev_name);
 		} else if (strcasecmp(tok, "sensor") == 0) {
-			/* sensor <name> <type> <device> <options...>
+			/* sensor <name> <type> [attr=value...] <device> <options...>
 			 */
 			struct aq_sensor *sen;
 			char **argv;
 			struct aq_process *proc;
 			const char *sen_name;
 			enum aq_sensor_type sen_type;
+			int (*start_reading)(void *priv);
+			int (*get_reading)(void *priv, uint64_t *reading);
+			void *priv;
+			char *val, *cp;
+			int64_t interval = AQ_SAMPLE_MS;
+			uint64_t deadband = 0;
+			int relative = 0, keyframe = 0;
+			int stream = 0;
 
 			/* Get sensor name */
 			tok = strtok_r(NULL, " \t,", &s);
@@ -1114,6 +2693,11 @@ int aq_config_read(struct aquaria *aq, const char *file)
 				       file, lineno, tok);
 				exit(EX_DATAERR);
 			}
+			if (strlen(tok) > AQ_FRAME_NAME_MAX) {
+				syslog(LOG_ERR, "%s:%d: Sensor name '%s' too long (> %d characters)",
+				       file, lineno, tok, AQ_FRAME_NAME_MAX);
+				exit(EX_DATAERR);
+			}
 			sen_name = tok;
 
 			/* Get sensor type */
@@ -1125,27 +2709,93 @@ int aq_config_read(struct aquaria *aq, const char *file)
 			}
 			sen_type = aq_sensor_nametype(tok);
 
-			/* Get sensor program name */
-			tok = strtok_r(NULL, " \t,", &s);
+			/* Get sensor attributes, then the program name */
+			while ((tok = read_attr(&s, &val)) != NULL && val != NULL) {
+				if (strcasecmp(tok, "mode") == 0 &&
+				    strcasecmp(val, "exec") == 0) {
+					stream = 0;
+				} else if (strcasecmp(tok, "mode") == 0 &&
+				           strcasecmp(val, "stream") == 0) {
+					stream = 1;
+				} else if (strcasecmp(tok, "interval") == 0) {
+					double secs = strtod(val, &cp);
+
+					/* At least a millisecond, the scheduler's unit */
+					if (cp == val || *cp != 0 || secs < 0.001) {
+						syslog(LOG_ERR, "%s:%d: Invalid sensor interval '%s'",
+						       file, lineno, val);
+						exit(EX_DATAERR);
+					}
+					interval = (int64_t)(secs * 1000);
+				} else if (strcasecmp(tok, "deadband") == 0) {
+					double band = strtod(val, &cp);
+
+					relative = (*cp == '%');
+					if (cp == val || *(cp + relative) != 0 || band < 0) {
+						syslog(LOG_ERR, "%s:%d: Invalid sensor deadband '%s'",
+						       file, lineno, val);
+						exit(EX_DATAERR);
+					}
+					deadband = relative ? (uint64_t)(band * 10000) : (uint64_t)band;
+				} else if (strcasecmp(tok, "keyframe") == 0) {
+					keyframe = strtol(val, &cp, 10);
+					if (cp == val || *cp != 0 || keyframe <= 0) {
+						syslog(LOG_ERR, "%s:%d: Invalid sensor keyframe '%s'",
+						       file, lineno, val);
+						exit(EX_DATAERR);
+					}
+				} else {
+					syslog(LOG_ERR, "%s:%d: Unrecognized sensor attribute '%s=%s'",
+					       file, lineno, tok, val);
+					exit(EX_DATAERR);
+				}
+			}
+
 			if (tok == NULL) {
 				syslog(LOG_ERR, "%s:%d: No device program given",
 				       file, lineno);
 				exit(EX_DATAERR);
 			}
 
-			proc = calloc(1, sizeof(*proc));
-			argv = malloc(sizeof(char *)*2);
-			argv[0] = strdup(tok);
-			argv[1] = NULL;		/* Tail end */
+			args[0] = tok;
 
 			/* Read in arguments */
-			proc->argv = read_args(1, argv, &s);
+			argv = read_args(aq, args, 1, &s);
+			if (argv == NULL) {
+				syslog(LOG_ERR, "%s:%d: Too many sensor arguments (> %d)",
+				       file, lineno, AQ_ARGS_MAX);
+				exit(EX_DATAERR);
+			}
+
+			if (aquaria_is_plugin(argv[0])) {
+				start_reading = NULL;
+				get_reading = aquaria_plugin(argv, "get_reading", &priv);
+				if (get_reading == NULL) {
+					syslog(LOG_ERR, "%s:%d: Cannot load sensor plugin '%s'", file, lineno, argv[0]);
+					exit(EX_DATAERR);
+				}
+			} else {
+				proc = aquaria_process(aq);
+				proc->argv = argv;
+				proc->stream = stream;
+				start_reading = aquaria_sensor_start;
+				get_reading = aquaria_sensor_exec;
+				priv = proc;
+			}
 
-			err = aquaria_sensor(aq, sen_name, sen_type, aquaria_sensor_exec, proc);
+			err = aquaria_sensor(aq, sen_name, sen_type, start_reading, get_reading, priv);
 			if (err < 0) {
 				syslog(LOG_ERR, "%s:%d: Cannot create device '%s'", file, lineno, argv[0]);
 				exit(EX_DATAERR);
 			}
+
+			/* First reading is due immediately */
+			sen = aq_sensor_find(aq, sen_name);
+			sen->interval = interval;
+			sen->logged.deadband = deadband;
+			sen->logged.relative = relative;
+			sen->logged.keyframe = keyframe;
+			aq_due_push(aq, sen);
 		} else {
 			syslog(LOG_ERR, "%s:%d: Unrecognized config directive '%s'",
 			       file, lineno, tok);
@@ -1223,7 +2873,7 @@ static int aq_sensor_unitize(enum aq_sensor_type type, uint64_t *pval, const cha
 		if (m < 0 || m >= 60) {
 			return -1;
 		}
-		*pval += (m * 60) * 1000000;
+		*pval += (m * 60) * 1000000ULL;
 		if (*rest == 0) {
 			break;
 		}
@@ -1434,6 +3084,51 @@ static int aq_cond_range(struct aq_condition *cond, char **s)
 	return 0;
 }
 
+static void aq_sched_edge(struct aquaria *aq, uint64_t tod)
+{
+	/* Times past midnight are never reached */
+	if (tod >= 24 * 3600 * 1000000ULL)
+		return;
+
+	aq->clock.edge = realloc(aq->clock.edge, sizeof(uint64_t) * (aq->clock.edges + 1));
+	aq->clock.edge[aq->clock.edges++] = tod;
+}
+
+/* Record when a Time condition's result can change
+ */
+static void aq_sched_edges(struct aquaria *aq, struct aq_condition *cond)
+{
+	uint64_t lo = cond->range.reading;
+	uint64_t hi = cond->range.reading + cond->range.span;
+
+	if (cond->sensor->type == AQ_SENSOR_WEEKDAY)
+		aq->clock.midnight = 1;
+
+	if (cond->sensor->type != AQ_SENSOR_TIME)
+		return;
+
+	aq->clock.midnight = 1;
+
+	switch (cond->operator) {
+	case AQ_COND_LESS:    aq_sched_edge(aq, lo); break;
+	case AQ_COND_LEQUAL:  aq_sched_edge(aq, lo + 1); break;
+	case AQ_COND_EQUAL:   aq_sched_edge(aq, lo); aq_sched_edge(aq, hi + 1); break;
+	case AQ_COND_IN:      aq_sched_edge(aq, lo + 1); aq_sched_edge(aq, hi); break;
+	case AQ_COND_AT:      aq_sched_edge(aq, lo); aq_sched_edge(aq, hi); break;
+	case AQ_COND_NEQUAL:  aq_sched_edge(aq, lo); aq_sched_edge(aq, hi + 1); break;
+	case AQ_COND_GEQUAL:  aq_sched_edge(aq, hi); break;
+	case AQ_COND_GREATER: aq_sched_edge(aq, hi + 1); break;
+	default: break;
+	}
+}
+
+static int aq_sched_edge_cmp(const void *a, const void *b)
+{
+	uint64_t ea = *(const uint64_t *)a, eb = *(const uint64_t *)b;
+
+	return (ea < eb) ? -1 : (ea > eb);
+}
+
 /* Read/Write the schedule config file.
  * These are comments-preserving routines.
  */
@@ -1442,6 +3137,7 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 	FILE *inf;
 	struct aq_line *line;
 	struct aq_condition **cond_ptr = NULL;
+	struct aq_device *line_dev = NULL;
 	int cond_id = 0;
 	char buff[1024+1], *s, *tok;
 	int lineno = 0;
@@ -1463,9 +3159,9 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 
 		buff[len - 1] = 0; /* Trim off the trailing \n */
 
-		line = calloc(1, sizeof(*line));
+		line = aq_alloc(aq, sizeof(*line));
 		line->num = lineno;
-		line->line = strdup(buff);
+		line->line = aq_strdup(aq, buff);
 
 		HASH_ADD_INT(aq->lines, num, line);
 
@@ -1517,6 +3213,7 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 			}
 
 			line->device = dev;
+			line_dev = dev;
 
 			/* Set current condition list */
 			cond_ptr = &dev->conditions;
@@ -1548,7 +3245,7 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 				exit(EX_DATAERR);
 			}
 
-			cond = calloc(1, sizeof(*cond));
+			cond = aq_alloc(aq, sizeof(*cond));
 			cond->id = cond_id++;
 			cond->sensor = sen;
 			cond->state = (is_on) ? AQ_STATE_ON : AQ_STATE_OFF;
@@ -1560,7 +3257,6 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 			}
 
 			if (err < 0) {
-				free(cond);
 				syslog(LOG_ERR, "%s:%d: Syntax error parsing conditions for a %s sensor",
 				       file, lineno, aq_sensor_typename(sen->type));
 				exit(EX_DATAERR);
@@ -1569,6 +3265,17 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 			line->condition = cond;
 
 			HASH_ADD_INT(*cond_ptr, id, cond);
+			aq_sched_edges(aq, cond);
+
+			/* A device's conditions are all in one block,
+			 * so it can only be the most recent dependent.
+			 */
+			if (sen->dependents_count == 0 ||
+			    sen->dependents[sen->dependents_count - 1] != line_dev) {
+				sen->dependents = realloc(sen->dependents,
+				                          sizeof(*sen->dependents) * (sen->dependents_count + 1));
+				sen->dependents[sen->dependents_count++] = line_dev;
+			}
 		} else {
 			syslog(LOG_ERR, "%s:%d: Unrecognized schedule directive '%s'",
 			       file, lineno, tok);
@@ -1577,6 +3284,9 @@ int aq_sched_read(struct aquaria *aq, const char *file)
 	}
 
 	fclose(inf);
+
+	qsort(aq->clock.edge, aq->clock.edges, sizeof(uint64_t), aq_sched_edge_cmp);
+
 	return 0;
 }
 
@@ -1656,44 +3366,420 @@ static enum aq_state aq_device_eval(struct aq_device *dev)
 	return (int)ret;
 }
 
-/* Evaluate the schedule
+/* Check outstanding device programs for completion or timeout
+ */
+static void aq_sched_check(struct aquaria *aq, int64_t now)
+{
+	struct aq_actuator *act, *next;
+
+	for (act = aq->busy; act != NULL; act = next) {
+		next = act->next;
+		aq_actuator_check(act, now);
+	}
+}
+
+/* Publish the state if it has changed since 'generation'.
+ * Returns 1 if it has.
+ */
+static int aq_sched_changed(struct aquaria *aq, unsigned int generation)
+{
+	if (aq->generation == generation)
+		return 0;
+
+	if (aq->shm != NULL)
+		aq_shm_update(aq->shm);
+
+	return 1;
+}
+
+int aq_sched_fd(struct aquaria *aq)
+{
+	return aq->epoll;
+}
+
+void aq_sched_deadline(struct aquaria *aq, int ms)
+{
+	aq->acquire.deadline = ms;
+}
+
+/* Call the handlers for ready watches, waiting up to 'ms'
+ */
+static void aq_sched_dispatch(struct aquaria *aq, int ms)
+{
+	struct epoll_event ev[16];
+	int i, n;
+
+	do {
+		n = epoll_wait(aq->epoll, ev, 16, ms);
+		for (i = 0; i < n; i++) {
+			struct aq_watch *watch = ev[i].data.ptr;
+
+			watch->handle(watch, ev[i].events);
+		}
+		ms = 0;
+	} while (n == 16);
+}
+
+int aq_sched_handle(struct aquaria *aq)
+{
+	unsigned int generation = aq->generation;
+
+	aq_sched_dispatch(aq, 0);
+	aq_sched_check(aq, aq_sched_ms());
+
+	/* That may have been the last reading */
+	if (aq->acquire.until != 0 && aq_sched_eval(aq))
+		return 1;
+
+	/* Or the end of a device program */
+	return aq_sched_changed(aq, generation);
+}
+
+/* Local time of day (in us) to wall clock time (in us)
+ */
+static int64_t aq_sched_wall(const struct tm *localnow, int mday, uint64_t tod)
+{
+	struct tm tm = *localnow;
+
+	tm.tm_mday += mday;
+	tm.tm_hour = tod / (3600 * 1000000ULL);
+	tm.tm_min = (tod / (60 * 1000000ULL)) % 60;
+	tm.tm_sec = (tod / 1000000ULL) % 60;
+	tm.tm_isdst = -1;
+
+	return mktime(&tm) * 1000000LL + (tod % 1000000ULL);
+}
+
+/* Next sensor reading, acquisition deadline, or device
+ * program timeout (CLOCK_MONOTONIC)
  */
-void aq_sched_eval(struct aquaria *aq)
+static void aq_sched_next_sample(struct aquaria *aq, struct timespec *sample)
+{
+	struct aq_actuator *act;
+	struct aq_device *dev;
+	int64_t next = INT64_MAX;
+
+	if (aq->acquire.until != 0)
+		next = aq->acquire.until;
+	else if (aq->acquire.dues > 0)
+		next = aq->acquire.due[0]->due;
+
+	for (act = aq->busy; act != NULL; act = act->next) {
+		if (act->expire < next)
+			next = act->expire;
+	}
+
+	for (dev = aq->retries; dev != NULL; dev = dev->retry_next) {
+		if (dev->retry < next)
+			next = dev->retry;
+	}
+
+	if (next == INT64_MAX) {
+		sample->tv_sec = 0;
+		sample->tv_nsec = 0;
+	} else {
+		/* Zero would disarm a timer, instead of firing it now */
+		if (next <= 0)
+			next = 1;
+		sample->tv_sec = next / 1000;
+		sample->tv_nsec = (next % 1000) * 1000000;
+	}
+}
+
+void aq_sched_next(struct aquaria *aq, struct timespec *wall, struct timespec *sample)
 {
+	struct timeval tv;
+	struct tm localnow;
 	struct aq_device *dev;
+	int64_t now, next = INT64_MAX;
+	uint64_t tod;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &localnow);
+	now = tv.tv_sec * 1000000LL + tv.tv_usec;
+
+	/* Everything else waits on the readings in progress */
+	if (aq->acquire.until != 0) {
+		wall->tv_sec = 0;
+		wall->tv_nsec = 0;
+		aq_sched_next_sample(aq, sample);
+		return;
+	}
+
+	/* Devices waiting for evaluation */
+	if (aq->dirty != NULL)
+		next = now;
+
+	/* Time condition edges, and midnight */
+	tod = (localnow.tm_hour * 3600 +
+	       localnow.tm_min * 60 +
+	       localnow.tm_sec) * 1000000ULL + tv.tv_usec;
+	for (i = 0; i < aq->clock.edges; i++) {
+		if (aq->clock.edge[i] > tod) {
+			int64_t t = aq_sched_wall(&localnow, 0, aq->clock.edge[i]);
+
+			if (t < next)
+				next = t;
+			break;
+		}
+	}
+
+	if (aq->clock.midnight) {
+		int64_t t = aq_sched_wall(&localnow, 1, 0);
+
+		if (t < next)
+			next = t;
+	}
+
+	/* Override expiry */
+	for (dev = aq->overrides; dev != NULL; dev = dev->override_next) {
+		if (dev->override.expire * 1000000LL < next)
+			next = dev->override.expire * 1000000LL;
+	}
+
+	if (next == INT64_MAX) {
+		wall->tv_sec = 0;
+		wall->tv_nsec = 0;
+	} else {
+		wall->tv_sec = next / 1000000;
+		wall->tv_nsec = (next % 1000000) * 1000;
+	}
+
+	aq_sched_next_sample(aq, sample);
+}
+
+/* Start all the sensor readings that are due. If any are
+ * to arrive later, the caller's event loop waits for them,
+ * up to the acquisition deadline.
+ */
+static void aq_sched_acquire(struct aquaria *aq)
+{
 	struct aq_sensor *sen;
-	enum aq_state state;
+	int64_t now;
 	int ret;
 
+	aq->acquire.tick++;
+	aq->acquire.outstanding = 0;
+
+	now = aq_sched_ms();
+	while (aq->acquire.dues > 0 && aq->acquire.due[0]->due <= now) {
+		sen = aq_due_pop(aq);
+		sen->sample = 1;
+
+		if (sen->start_reading != NULL) {
+			ret = sen->start_reading(sen->priv);
+			if (ret > 0) {
+				sen->pending = 1;
+				aq->acquire.outstanding++;
+			}
+		}
+
+		/* Always move past now, or this never ends */
+		sen->due += sen->interval;
+		if (sen->due <= now)
+			sen->due = now + ((sen->interval > 0) ? sen->interval : 1);
+		aq_due_push(aq, sen);
+	}
+
+	if (aq->acquire.outstanding > 0)
+		aq->acquire.until = now + aq->acquire.deadline;
+}
+
+/* Does a reading differ enough from the last one logged, or
+ * has it been long enough since, to be logged?
+ */
+static int aq_sensor_log_due(struct aq_sensor *sen, time_t now)
+{
+	uint64_t last = sen->logged.reading;
+	uint64_t change, band;
+
+	if (sen->logged.time == 0)
+		return 1;
+
+	if (sen->logged.keyframe > 0 && now - sen->logged.time >= sen->logged.keyframe)
+		return 1;
+
+	change = (sen->reading > last) ? sen->reading - last : last - sen->reading;
+	band = sen->logged.deadband;
+	if (sen->logged.relative)
+		band = (uint64_t)((double)last * band / 1000000);
+
+	return change > band;
+}
+
+/* Take the readings, and evaluate the schedule
+ */
+static void aq_sched_update(struct aquaria *aq)
+{
+	struct aq_device *dev, **pdev;
+	struct aq_sensor *sen;
+	enum aq_state state;
+	int64_t now;
+	int ret, id;
+
 	gettimeofday(&reading_time.now, NULL);
 	localtime_r(&reading_time.now.tv_sec, &reading_time.localnow);
 
+	/* Re-evaluate devices whose overrides have expired
+	 */
+	for (pdev = &aq->overrides; (dev = *pdev) != NULL; ) {
+		if (dev->override.expire > reading_time.now.tv_sec) {
+			pdev = &dev->override_next;
+			continue;
+		}
+		*pdev = dev->override_next;
+		dev->overridden = 0;
+		aq_device_dirty(dev);
+	}
+
+	/* Re-evaluate devices whose state changes failed
+	 */
+	now = aq_sched_ms();
+	for (pdev = &aq->retries; (dev = *pdev) != NULL; ) {
+		if (dev->retry > now) {
+			pdev = &dev->retry_next;
+			continue;
+		}
+		*pdev = dev->retry_next;
+		dev->retrying = 0;
+		aq_device_dirty(dev);
+	}
+
 	/* Update and log all the readings
 	 */
 	log_start(aq->log, &reading_time.now);
-	for (sen = aq->sensors; sen != NULL; sen = sen->hh.next) {
+	for (id = 0, sen = aq->sensors; sen != NULL; sen = sen->hh.next, id++) {
 		uint64_t reading;
+
+		/* Configured in-process sensors are only read when due */
+		if (sen->start_reading == NULL && sen->interval > 0 && !sen->sample)
+			continue;
+
 		ret = sen->get_reading(sen->priv, &reading);
 		if (ret == 1) {
+			if (sen->overdue)
+				sen->late++;
+			sen->overdue = 0;
+			if (sen->reading != reading) {
+				int i;
+
+				for (i = 0; i < sen->dependents_count; i++)
+					aq_device_dirty(sen->dependents[i]);
+			}
 			sen->reading = reading;
-			if (sen->log_id != NULL)
+			if (sen->log_id != NULL && aq_sensor_log_due(sen, reading_time.now.tv_sec)) {
 				log_sensor(aq->log, sen->log_id, sen->reading);
-		}
+				sen->logged.reading = sen->reading;
+				sen->logged.time = reading_time.now.tv_sec;
+			}
+			if (aq->rollup != NULL)
+				aq_rollup_add(aq->rollup, id, reading_time.now.tv_sec, reading);
+		} else if (sen->pending) {
+			sen->missed++;
+			sen->overdue = 1;
+		}
+		sen->pending = 0;
+		sen->sample = 0;
 	}
 
-	for (dev = aq->devices; dev != NULL; dev = dev->hh.next) {
+	/* Only evaluate devices whose inputs have changed
+	 */
+	while ((dev = aq->dirty) != NULL) {
+		aq->dirty = dev->dirty_next;
+		dev->dirty = 0;
+
 		state = aq_device_eval(dev);
 		if (state != AQ_STATE_UNCHANGED &&
 		    dev->state != state) {
 			int is_on = (state == AQ_STATE_ON) ? 1 : 0;
 
-			dev->set_state(dev->priv, is_on);
+			ret = dev->set_state(dev->priv, is_on);
+			dev->status = (ret < 0) ? ret : 0;
+			if (ret < 0) {
+				dev->failures++;
+				syslog(LOG_ERR, "%s: Can't turn %s: %s", dev->name,
+				       is_on ? "on" : "off", strerror(-ret));
+				aq_device_retry(dev);
+				continue;
+			}
 			dev->state = state;
 			if (dev->log_id != NULL)
 				log_device(aq->log, dev->log_id, is_on);
 		}
 	}
 	log_pause(aq->log);
+
+	aq->generation++;
+	if (aq->shm != NULL)
+		aq_shm_update(aq->shm);
+}
+
+/* Evaluate the schedule, once the readings are in
+ */
+int aq_sched_eval(struct aquaria *aq)
+{
+	unsigned int generation = aq->generation;
+
+	aq_sched_check(aq, aq_sched_ms());
+
+	if (aq->acquire.until == 0)
+		aq_sched_acquire(aq);
+
+	if (aq->acquire.until != 0 && aq->acquire.outstanding > 0 &&
+	    aq_sched_ms() < aq->acquire.until)
+		return aq_sched_changed(aq, generation);
+
+	aq->acquire.until = 0;
+	aq_sched_update(aq);
+
+	return 1;
+}
+
+int aq_shm_publish(struct aquaria *aq, const char *name)
+{
+	if (aq->shm != NULL)
+		aq_shm_destroy(aq->shm);
+
+	aq->shm = aq_shm_create(aq, name);
+	if (aq->shm == NULL)
+		return -errno;
+
+	return 0;
+}
+
+int aq_rollup_open(struct aquaria *aq, const char *path)
+{
+	if (aq->rollup != NULL)
+		aq_rollup_destroy(aq->rollup);
+
+	aq->rollup = aq_rollup_create(aq, path);
+	if (aq->rollup == NULL)
+		return -errno;
+
+	return 0;
+}
+
+int aq_sensor_history(struct aquaria *aq, struct aq_sensor *sen, unsigned int *secs,
+                      time_t from, time_t to,
+                      int (*bucket)(void *priv, time_t time, const struct aq_binlog_stats *st),
+                      void *priv)
+{
+	struct aq_sensor *s;
+	int id;
+
+	if (aq->rollup == NULL)
+		return -ENOENT;
+
+	for (id = 0, s = aq->sensors; s != NULL && s != sen; s = s->hh.next)
+		id++;
+
+	return aq_rollup_read(aq->rollup, id, secs, from, to, bucket, priv);
+}
+
+unsigned int aq_generation(struct aquaria *aq)
+{
+	return aq->generation;
 }
 
 /* Get the first device
@@ -1725,7 +3811,15 @@ enum aq_state aq_device_get(struct aq_device *dev, time_t *override)
 	return dev->state;
 }
 
-void aq_device_set(struct aq_device *dev, enum aq_state state, time_t *override)
+/* Get the results of a device's state changes
+ */
+void aq_device_stats(struct aq_device *dev, int *status, unsigned int *failures)
+{
+	*status = dev->status;
+	*failures = dev->failures;
+}
+
+static void aq_device_override(struct aq_device *dev, enum aq_state state, time_t *override)
 {
 	if (override != NULL) {
 		dev->override.expire = time(NULL) + *override;
@@ -1735,9 +3829,28 @@ void aq_device_set(struct aq_device *dev, enum aq_state state, time_t *override)
 	}
 	dev->override.state = state;
 
+	aq_device_dirty(dev);
+	dev->aq->generation++;
+	if (!dev->overridden) {
+		dev->overridden = 1;
+		dev->override_next = dev->aq->overrides;
+		dev->aq->overrides = dev;
+	}
+}
+
+void aq_device_set(struct aq_device *dev, enum aq_state state, time_t *override)
+{
+	aq_device_override(dev, state, override);
 	aq_sync(dev->aq, "set-device", dev);
 }
 
+int aq_device_set_start(struct aq_device *dev, enum aq_state state, time_t *override,
+                        aq_done_fn done, void *priv)
+{
+	aq_device_override(dev, state, override);
+	return aq_request_start(dev->aq, "set-device", dev, done, priv);
+}
+
 /* Get the first device condition
  */
 struct aq_condition *aq_device_conditions(struct aq_device *dev)
@@ -1808,3 +3921,28 @@ uint64_t aq_sensor_reading(struct aq_sensor *sen)
 {
 	return sen->reading;
 }
+
+int aq_log_binary(struct aquaria *aq, const char *path)
+{
+	return log_binary(aq->log, path);
+}
+
+int aq_log_rotate(struct aquaria *aq, uint64_t size, unsigned int secs)
+{
+	return log_rotate(aq->log, size, secs);
+}
+
+/* Get the statistics of the log writer's ring
+ */
+void aq_log_stats(struct aquaria *aq, unsigned int *overflows, unsigned int *dropped)
+{
+	log_stats(aq->log, overflows, dropped);
+}
+
+/* Get the acquisition statistics of a sensor
+ */
+void aq_sensor_stats(struct aq_sensor *sen, unsigned int *late, unsigned int *missed)
+{
+	*late = sen->late;
+	*missed = sen->missed;
+}
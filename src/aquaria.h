@@ -69,7 +69,14 @@ struct aq_condition;
 extern "C" {
 #endif
 
+/* Where the daemon listens for local clients, by default
+ */
+#define AQ_SOCKET_DEFAULT	"/var/run/aquaria.sock"
+
 /* Instantiation
+ *
+ * aq_connect() takes an AF_INET or an AF_UNIX address.
+ * aq_create() logs in VCD format to 'log', unless it is NULL.
  */
 struct aquaria *aq_connect(const struct sockaddr *sin, socklen_t len);
 struct aquaria *aq_create(const char *log, int noop);
@@ -85,14 +92,132 @@ int aq_config_read(struct aquaria *aq, const char *file);
 int aq_sched_read(struct aquaria *aq, const char *file);
 
 /* server: Evaluate the schedule
+ *
+ * All sensor readings that are due are started together. The
+ * schedule is evaluated once they are all in, or once the
+ * acquisition deadline (default 800ms) passes, whichever is
+ * first. Neither blocks: returns 1 if the schedule was
+ * evaluated, or 0 if it is waiting on readings. The rest
+ * happens in aq_sched_handle(), or in a later call when
+ * the 'sample' time from aq_sched_next() is reached.
+ *
+ * Also returns 1 if a device program has since finished
+ * or timed out, as that changes the state too.
+ */
+int aq_sched_eval(struct aquaria *aq);
+
+/* server: Count of changes to the sensor and device state.
+ *
+ * Bumped by every aq_sched_eval(), aq_device_set() and finished
+ * device program; anything
+ * derived from the state is current until this changes.
+ */
+unsigned int aq_generation(struct aquaria *aq);
+
+/* server: Statistics of the log writer's ring
+ *  overflows - times the ring filled up
+ *  dropped   - readings and state changes lost while it was full
+ */
+void aq_log_stats(struct aquaria *aq, unsigned int *overflows, unsigned int *dropped);
+
+/* server: Also log the readings and device changes to the binary
+ * log at 'path' (see aq_binlog_open()). Call before the
+ * configuration is read.
+ */
+int aq_log_binary(struct aquaria *aq, const char *path);
+
+/* server: Rotate the logs every 'size' bytes of VCD, and/or on
+ * every multiple of 'secs' seconds since the epoch (0 for no
+ * limit). Closed segments are renamed after their time range,
+ * ie log.vcd becomes log.<start>-<end>.vcd with UTC times such
+ * as 20100612T140000Z, and VCD segments are then gzip'd in the
+ * background. Call before aq_log_binary().
+ */
+int aq_log_rotate(struct aquaria *aq, uint64_t size, unsigned int secs);
+
+/* server: Publish the sensor readings and device states in the
+ * POSIX shared memory object 'name', updated after every
+ * aq_sched_eval(). Call once the configuration has been read.
+ */
+int aq_shm_publish(struct aquaria *aq, const char *name);
+
+/* server: Set the sensor acquisition deadline, in milliseconds
  */
-void aq_sched_eval(struct aquaria *aq);
+void aq_sched_deadline(struct aquaria *aq, int ms);
+
+/* server: When to next evaluate the schedule
+ *
+ * 'wall' is set to the CLOCK_REALTIME time when a Time or Weekday
+ * condition, or an override, can next change the schedule.
+ *
+ * 'sample' is set to the CLOCK_MONOTONIC time when the next sensor
+ * reading is due, a device program times out, or a device whose
+ * state change failed is tried again; or while readings are in
+ * progress, to their deadline.
+ *
+ * Either is set to zero if there is nothing to wait for.
+ */
+void aq_sched_next(struct aquaria *aq, struct timespec *wall, struct timespec *sample);
+
+/* server: File descriptor that becomes readable when sensor
+ * and device programs need attention. Call aq_sched_handle()
+ * when it does; it returns 1 if that changed the state, by
+ * finishing an evaluation of the schedule (see aq_sched_eval())
+ * or a device program.
+ */
+int aq_sched_fd(struct aquaria *aq);
+int aq_sched_handle(struct aquaria *aq);
 
 /* Refresh sensor and device states (for client connections,
  * unneeded on server)
  */
 int aq_sync(struct aquaria *aq, const char *request, const struct aq_device *dev);
 
+/* client: Asynchronous requests.
+ *
+ * aq_connect_async() returns a handle without contacting the daemon.
+ * The *_start() calls queue a request and return at once; 'done' is
+ * called from aq_process() with 0 or a negative errno once the reply
+ * has been applied. Poll aq_fd() for aq_events(), and call
+ * aq_process() when it is ready. aq_fd() may change after a call
+ * to aq_process().
+ */
+typedef void (*aq_done_fn)(struct aquaria *aq, int err, void *priv);
+
+struct aquaria *aq_connect_async(const struct sockaddr *sin, socklen_t len);
+int aq_fd(struct aquaria *aq);
+short aq_events(struct aquaria *aq);
+int aq_process(struct aquaria *aq);
+int aq_sync_start(struct aquaria *aq, aq_done_fn done, void *priv);
+
+/* client: Use the compact binary protocol, from the next request
+ * on. Fails with -EBUSY while requests are outstanding.
+ */
+int aq_binary(struct aquaria *aq);
+
+/* client: Have the daemon push its state after every evaluation
+ * of the schedule that changes it, instead of polling with
+ * aq_sync_start(). Needs the binary protocol.
+ *
+ * 'done' is called with 0 once the current state has arrived,
+ * again after each reconnection, and with a negative errno when
+ * the subscription ends; it may then be started again. The
+ * updates are applied by aq_process(), which aq_events() asks
+ * for as long as the subscription lasts.
+ */
+int aq_subscribe_start(struct aquaria *aq, aq_done_fn done, void *priv);
+
+/* client: Batched device changes.
+ *
+ * Between aq_batch_begin() and aq_batch_commit(), aq_device_set()
+ * and aq_device_set_start() only record the change. The commit
+ * sends them all in one request, which the daemon applies together
+ * or not at all; their callbacks run when the batch completes.
+ */
+int aq_batch_begin(struct aquaria *aq);
+int aq_batch_commit(struct aquaria *aq);
+int aq_batch_commit_start(struct aquaria *aq, aq_done_fn done, void *priv);
+
 /* Get the first device
  */
 struct aq_device *aq_devices(struct aquaria *aq);
@@ -112,7 +237,16 @@ struct aq_device *aq_device_find(struct aquaria *aq, const char *name);
 /* Get current desired state of a device.
  */
 enum aq_state aq_device_get(struct aq_device *dev, time_t *override);
+
+/* Get the results of a device's state changes
+ *  status   - 0, or the negative errno (or program exit code) of
+ *             the last change, which leaves the state unknown
+ *  failures - changes that failed
+ */
+void aq_device_stats(struct aq_device *dev, int *status, unsigned int *failures);
 void aq_device_set(struct aq_device *dev, enum aq_state, time_t *override);
+int aq_device_set_start(struct aq_device *dev, enum aq_state, time_t *override,
+                        aq_done_fn done, void *priv);
 
 /* Get the first device condition
  */
@@ -155,6 +289,12 @@ struct aq_sensor *aq_sensor_find(struct aquaria *aq, const char *name);
 enum aq_sensor_type aq_sensor_type(struct aq_sensor *sen);
 uint64_t aq_sensor_reading(struct aq_sensor *sen);
 
+/* Get the acquisition statistics of a sensor
+ *  late   - readings that arrived after their deadline
+ *  missed - deadlines that passed without a reading
+ */
+void aq_sensor_stats(struct aq_sensor *sen, unsigned int *late, unsigned int *missed);
+
 /* Type to name mappings
  */
 enum aq_sensor_type aq_sensor_nametype(const char *name);
@@ -164,6 +304,120 @@ const char *aq_sensor_typename(enum aq_sensor_type type);
 /* Type to units mappings */
 const char *aq_sensor_typeunits(enum aq_sensor_type type);
 
+/* Driver plugins
+ *
+ * A 'sensor' or 'device' program in the config file that ends
+ * in '.so' is loaded with dlopen(), and called in-process.
+ *
+ * A sensor plugin exports:
+ *
+ *   int get_reading(void *priv, uint64_t *reading);
+ *
+ *     Returns 1 and sets *reading when a new reading is available,
+ *     0 when there is no new reading, or < 0 on error.
+ *
+ * A device plugin exports:
+ *
+ *   int set_state(void *priv, int is_on);
+ *
+ *     Returns 0 on success, or < 0 on error.
+ *
+ * Either may also export:
+ *
+ *   void *driver_open(int argc, char **argv);
+ *
+ *     Called once when the config file is read, with argv[0] set
+ *     to the plugin path, and the remaining arguments from the
+ *     config line. Its return value is passed as 'priv' to the
+ *     callback. Return NULL on failure.
+ *
+ * If driver_open() is not exported, 'priv' is the argv array.
+ */
+
+/* Local readers of a daemon's shared memory state (see
+ * aq_shm_publish()). Nothing here makes a system call.
+ *
+ * Sensors and devices are known by their index, from 0 to
+ * aq_shm_sensors() - 1 or aq_shm_devices() - 1. Reads return 0,
+ * or -ESTALE once the daemon has let go of the segment, in
+ * which case it should be opened again. If the daemon dies,
+ * that is only seen when it next starts; until then the
+ * state is as it left it, and aq_shm_generation() stands still.
+ */
+#define AQ_SHM_DEFAULT	"/aquaria"
+
+struct aq_shm;
+
+struct aq_shm *aq_shm_open(const char *name);
+void aq_shm_close(struct aq_shm *shm);
+int aq_shm_closed(struct aq_shm *shm);
+unsigned int aq_shm_generation(struct aq_shm *shm);
+int aq_shm_sensors(struct aq_shm *shm);
+int aq_shm_devices(struct aq_shm *shm);
+const char *aq_shm_sensor_name(struct aq_shm *shm, int id);
+const char *aq_shm_device_name(struct aq_shm *shm, int id);
+int aq_shm_sensor_find(struct aq_shm *shm, const char *name);
+int aq_shm_device_find(struct aq_shm *shm, const char *name);
+int aq_shm_sensor_reading(struct aq_shm *shm, int id, uint64_t *reading);
+int aq_shm_device_state(struct aq_shm *shm, int id, enum aq_state *state, time_t *override);
+
+/* All readings and device states from the same update; either
+ * array may be NULL.
+ */
+int aq_shm_read(struct aq_shm *shm, uint64_t *readings, enum aq_state *states,
+                unsigned int *generation);
+
+/* Readers of a binary log (see aq_log_binary()). The file is
+ * mapped, and indexed when opened; reopen it to see what the
+ * daemon has written since.
+ *
+ * Wires are known by their index, from 0 to aq_binlog_wires() - 1,
+ * and named "Sensor.<name>" or "Device.<name>". Times are in us
+ * since the epoch, and ranges include both ends.
+ *
+ * aq_binlog_read() calls sample() for each reading in the range,
+ * until it returns non-zero, and returns that.
+ */
+struct aq_binlog;
+
+struct aq_binlog_stats {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+};
+
+struct aq_binlog *aq_binlog_open(const char *path);
+void aq_binlog_close(struct aq_binlog *bl);
+int aq_binlog_wires(struct aq_binlog *bl);
+const char *aq_binlog_name(struct aq_binlog *bl, int id);
+int aq_binlog_find(struct aq_binlog *bl, const char *name);
+int aq_binlog_read(struct aq_binlog *bl, int id, uint64_t from, uint64_t to,
+                   int (*sample)(void *priv, uint64_t time, uint64_t value),
+                   void *priv);
+int aq_binlog_aggregate(struct aq_binlog *bl, int id, uint64_t from, uint64_t to,
+                        struct aq_binlog_stats *st);
+
+/* server: Keep rollups of every sensor's readings in the file at
+ * 'path': the min, max, sum and count of them for each second of
+ * the last hour, each minute of the last week, and each hour of the
+ * last year. The file is kept across restarts, and its sensors are
+ * matched up by name. Call once the configuration has been read.
+ */
+int aq_rollup_open(struct aquaria *aq, const char *path);
+
+/* server: Rollups of a sensor's readings, oldest first. bucket() is
+ * called for each interval of '*secs' (1, 60 or 3600) from 'from' to
+ * 'to' that had readings, with its start, until it returns non-zero.
+ * If '*secs' is 0, it is set to the finest that goes back to 'from'.
+ * The time taken is bounded by the size of the rollup, however long
+ * the range.
+ */
+int aq_sensor_history(struct aquaria *aq, struct aq_sensor *sen, unsigned int *secs,
+                      time_t from, time_t to,
+                      int (*bucket)(void *priv, time_t time, const struct aq_binlog_stats *st),
+                      void *priv);
+
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,182 @@
+/*
+ * Aquarium Power Manager
+ * Benchmark: connection accept/close throughput
+ *
+ * Opens CLIENTS connections at once, sends each a single
+ * request, and closes each when the server has replied.
+ * Reports connections per second over all the rounds.
+ *
+ * GPL v2.0
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+
+static const char bench_request[] = "{\"request\":\"get-device\"}";
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [options]\n"
+			"\n"
+			"Options:\n"
+			"  -p PORT, --port NUM         aquaria port (default 4444)\n"
+			"  -c NUM, --clients NUM       concurrent clients (default 1000)\n"
+			"  -r NUM, --rounds NUM        rounds of clients (default 20)\n"
+			"  -i NUM, --idle NUM          idle connections kept open\n"
+			"                              throughout (default 0)\n"
+			,program);
+	exit(EXIT_FAILURE);
+}
+
+static int bench_connect(const struct sockaddr_in *sin)
+{
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (const struct sockaddr *)sin, sizeof(*sin)) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+
+	return fd;
+}
+
+/* Room for the clients, the idle connections, and stdio */
+static void bench_files(int files)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= files)
+		return;
+
+	rl.rlim_cur = (rl.rlim_max < files) ? rl.rlim_max : files;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin = {};
+	struct timespec start, end;
+	int port = 4444, clients = 1000, rounds = 20, idle = 0;
+	int c, option, i, r, *fd;
+	long conns = 0;
+	double secs;
+	char buf[4096], *cp;
+	struct option options[] = {
+		{ .name = "port", .has_arg = 1, .flag = NULL, .val = 'p' },
+		{ .name = "clients", .has_arg = 1, .flag = NULL, .val = 'c' },
+		{ .name = "rounds", .has_arg = 1, .flag = NULL, .val = 'r' },
+		{ .name = "idle", .has_arg = 1, .flag = NULL, .val = 'i' },
+		{ .name = "help", .has_arg = 0, .flag = NULL, .val = 'h' },
+		{ .name = NULL },
+	};
+
+	while ((c = getopt_long(argc, argv, "c:hi:p:r:", options, &option)) >= 0) {
+		switch (c) {
+		case 'p':
+			port = strtol(optarg, &cp, 0);
+			if (*cp != 0 || port <= 0 || port > 65535)
+				usage(argv[0]);
+			break;
+		case 'c':
+			clients = strtol(optarg, &cp, 0);
+			if (*cp != 0 || clients <= 0)
+				usage(argv[0]);
+			break;
+		case 'r':
+			rounds = strtol(optarg, &cp, 0);
+			if (*cp != 0 || rounds <= 0)
+				usage(argv[0]);
+			break;
+		case 'i':
+			idle = strtol(optarg, &cp, 0);
+			if (*cp != 0 || idle < 0)
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	bench_files(clients + idle + 16);
+
+	fd = calloc(clients, sizeof(*fd));
+	if (fd == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	/* Never closed; the server has to carry them */
+	for (i = 0; i < idle; i++) {
+		if (bench_connect(&sin) < 0) {
+			fprintf(stderr, "Can't open idle connection %d: %s\n",
+				i, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < clients; i++) {
+			fd[i] = bench_connect(&sin);
+			if (fd[i] < 0) {
+				fprintf(stderr, "Can't connect client %d: %s\n",
+					i, strerror(-fd[i]));
+				return EXIT_FAILURE;
+			}
+		}
+
+		for (i = 0; i < clients; i++) {
+			if (write(fd[i], bench_request, sizeof(bench_request) - 1) < 0 ||
+			    shutdown(fd[i], SHUT_WR) < 0) {
+				perror("write");
+				return EXIT_FAILURE;
+			}
+		}
+
+		/* The server closes after replying to a half-closed client */
+		for (i = 0; i < clients; i++) {
+			ssize_t len, total = 0;
+
+			while ((len = read(fd[i], buf, sizeof(buf))) > 0)
+				total += len;
+
+			if (len < 0 || total == 0) {
+				fprintf(stderr, "No reply for client %d\n", i);
+				return EXIT_FAILURE;
+			}
+
+			close(fd[i]);
+			conns++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d clients x %d rounds, %d idle: %ld connections in %.3fs, %.0f/s\n",
+	       clients, rounds, idle, conns, secs, conns / secs);
+
+	free(fd);
+
+	return EXIT_SUCCESS;
+}
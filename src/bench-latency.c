@@ -0,0 +1,165 @@
+/*
+ * Aquarium Power Manager
+ * Benchmark: get-sensor round trip, TCP loopback vs UNIX socket
+ *
+ * Sends REQUESTS get-sensor requests, one at a time, over each
+ * transport in turn, and reports the mean, median and 99th
+ * percentile round trip.
+ *
+ * GPL v2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "aquaria.h"
+
+/* Requests before timing starts */
+#define BENCH_WARMUP	2000
+
+static void usage(const char *program)
+{
+	fprintf(stderr, "Usage:\n"
+			"%s [options]\n"
+			"\n"
+			"Options:\n"
+			"  -p PORT, --port NUM         aquaria port (default 4444)\n"
+			"  -u PATH, --unix PATH        aquaria UNIX socket (default\n"
+			"                              " AQ_SOCKET_DEFAULT ")\n"
+			"  -n NUM, --requests NUM      requests per transport\n"
+			"                              (default 100000)\n"
+			"  -b, --binary                use the binary protocol\n"
+			,program);
+	exit(EXIT_FAILURE);
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y) ? -1 : (x > y);
+}
+
+static int bench_run(const char *name, const struct sockaddr *sa, socklen_t len,
+		     int binary, double *us, int requests)
+{
+	struct aquaria *aq;
+	struct timespec a, b;
+	double sum = 0;
+	int i, err;
+
+	aq = aq_connect_async(sa, len);
+	if (aq == NULL) {
+		fprintf(stderr, "%s: Can't connect\n", name);
+		return -1;
+	}
+
+	if (binary)
+		aq_binary(aq);
+
+	for (i = 0; i < BENCH_WARMUP; i++) {
+		err = aq_sync(aq, (i == 0) ? NULL : "get-sensor", NULL);
+		if (err < 0)
+			goto fail;
+	}
+
+	for (i = 0; i < requests; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &a);
+		err = aq_sync(aq, "get-sensor", NULL);
+		clock_gettime(CLOCK_MONOTONIC, &b);
+		if (err < 0)
+			goto fail;
+
+		us[i] = (b.tv_sec - a.tv_sec) * 1e6 +
+			(b.tv_nsec - a.tv_nsec) / 1e3;
+		sum += us[i];
+	}
+
+	qsort(us, requests, sizeof(*us), bench_cmp);
+	printf("%-8s %-6s mean %6.1f us  p50 %6.1f  p99 %6.1f\n",
+	       name, binary ? "binary" : "JSON", sum / requests,
+	       us[requests / 2], us[requests * 99 / 100]);
+
+	aq_free(aq);
+	return 0;
+
+fail:
+	fprintf(stderr, "%s: Request failed: %s\n", name, strerror(-err));
+	aq_free(aq);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sin = {};
+	struct sockaddr_un sun = {};
+	int port = 4444, requests = 100000, binary = 0;
+	const char *unix_path = AQ_SOCKET_DEFAULT;
+	int c, option, err;
+	double *us;
+	char *cp;
+	struct option options[] = {
+		{ .name = "port", .has_arg = 1, .flag = NULL, .val = 'p' },
+		{ .name = "unix", .has_arg = 1, .flag = NULL, .val = 'u' },
+		{ .name = "requests", .has_arg = 1, .flag = NULL, .val = 'n' },
+		{ .name = "binary", .has_arg = 0, .flag = NULL, .val = 'b' },
+		{ .name = "help", .has_arg = 0, .flag = NULL, .val = 'h' },
+		{ .name = NULL },
+	};
+
+	while ((c = getopt_long(argc, argv, "bhn:p:u:", options, &option)) >= 0) {
+		switch (c) {
+		case 'p':
+			port = strtol(optarg, &cp, 0);
+			if (*cp != 0 || port <= 0 || port > 65535)
+				usage(argv[0]);
+			break;
+		case 'u':
+			unix_path = optarg;
+			if (strlen(unix_path) >= sizeof(sun.sun_path))
+				usage(argv[0]);
+			break;
+		case 'n':
+			requests = strtol(optarg, &cp, 0);
+			if (*cp != 0 || requests < 100)
+				usage(argv[0]);
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	us = calloc(requests, sizeof(*us));
+	if (us == NULL) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, unix_path);
+
+	err = bench_run("TCP", (struct sockaddr *)&sin, sizeof(sin),
+			binary, us, requests);
+	if (err == 0)
+		err = bench_run("UNIX", (struct sockaddr *)&sun, sizeof(sun),
+				binary, us, requests);
+
+	free(us);
+
+	return (err < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -20,138 +20,821 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
+#include <limits.h>
 #include <search.h>
+#include <pthread.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "aquaria.h"
+#include "aq_binlog.h"
 #include "log.h"
 
+/* Records in the ring. A power of two; raise it if
+ * log_stats() shows drops (the daemon reports them
+ * when it exits).
+ */
+#define LOG_RING_SIZE	4096
+
+/* One reading or state change, as queued by the
+ * evaluator for the writer thread.
+ */
+struct log_rec {
+	uint64_t time;		/* ns */
+	uint64_t value;
+	uint32_t wire;
+	uint32_t type;
+};
+
+enum {
+	LOG_REC_REAL,		/* Sensor reading */
+	LOG_REC_BIT,		/* Device state */
+};
+
+/* Closed segments waiting to be compressed
+ */
+struct log_gz {
+	struct log_gz *next;
+	char path[];
+};
+
 struct log {
-	FILE *file;
+	FILE *file;		/* VCD, or NULL */
+	char *path;
+	struct aq_binlog *bin;	/* Binary, or NULL */
+	char *bin_path;
 	struct hsearch_data hash;
 	int wire_id;
+	struct log_wire {
+		char *name;	/* "Sensor.<name>" or "Device.<name>" */
+		int type;
+		int valid;	/* Has a value */
+		uint64_t value;	/* Last one written */
+	} *wires;		/* By wire number */
 	enum { LOG_STATE_INIT, LOG_STATE_ACTIVE } state;
+	uint64_t time;		/* Of the current entry */
+
+	/* Single producer (the evaluator), single consumer
+	 * (the writer thread). Each index is only written
+	 * by its own side.
+	 */
+	struct log_rec *ring;
+	unsigned int head;	/* Next to fill */
+	unsigned int tail;	/* Next to write */
+	int full;		/* Dropping since the ring filled */
+	unsigned int overflows;	/* Times the ring filled */
+	unsigned int dropped;	/* Records lost to a full ring */
+
+	pthread_t writer;
+	int wake;		/* eventfd */
+	int stop;
+
+	/* Rotation, if size or secs is set. The writer thread
+	 * starts a new segment at the first entry past either
+	 * limit, and renames the old one after its time range.
+	 */
+	struct {
+		uint64_t size;	/* Bytes of VCD */
+		unsigned int secs;
+		uint64_t start;	/* ns, of this segment */
+		uint64_t last;
+		uint64_t until;	/* ns, 0 if no time limit */
+	} rotate;
+
+	/* Compressor of rotated VCD segments */
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		struct log_gz *head, **tail;
+		pthread_t thread;
+		int running;
+		int stop;
+	} gz;
 };
 
-/* Open/close the log (VCD format)
+/* Timestamp of the VCD entries that follow
+ */
+static void log_time(FILE *file, uint64_t time)
+{
+	fprintf(file, "#%u%06u\n", (unsigned int)(time / 1000000000),
+	        (unsigned int)(time % 1000000000));
+}
+
+/* Write the VCD header, and the value of every wire as of 'time'
+ * if there are any yet
+ */
+static void log_header(struct log *log, uint64_t time)
+{
+	char date[32];
+	time_t secs = time / 1000000000;
+	struct tm tm;
+	int i, dump = 0;
+
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime_r(&secs, &tm));
+
+	fprintf(log->file, "$date %s $end\n", date);
+	fprintf(log->file, "$version Aquaria Aquarium Controller $end\n");
+	fprintf(log->file, "$timescale 1 ns $end\n");
+	fprintf(log->file, "$scope module Aquaria $end\n");
+	for (i = 1; i < log->wire_id; i++) {
+		if (log->wires[i].type == LOG_REC_REAL)
+			fprintf(log->file, "$var real 64 %X %s $end\n", i, log->wires[i].name);
+		else
+			fprintf(log->file, "$var wire 1 %X %s $end\n", i, log->wires[i].name);
+		dump |= log->wires[i].valid;
+	}
+	fprintf(log->file, "$upscope $end\n");
+	fprintf(log->file, "$enddefinitions $end\n");
+
+	if (!dump)
+		return;
+
+	log_time(log->file, time);
+	fprintf(log->file, "$dumpvars\n");
+	for (i = 1; i < log->wire_id; i++) {
+		if (!log->wires[i].valid)
+			continue;
+		if (log->wires[i].type == LOG_REC_REAL)
+			fprintf(log->file, "r%.16g %X\n", (double)log->wires[i].value, i);
+		else
+			fprintf(log->file, "b%d %X\n", log->wires[i].value ? 1 : 0, i);
+	}
+	fprintf(log->file, "$end\n");
+}
+
+#ifdef HAVE_LIBZ
+/* Compress 'path' to 'path'.gz, and remove it
+ */
+static int log_gzip(const char *path)
+{
+	char gz[PATH_MAX], *buff;
+	FILE *in;
+	gzFile out;
+	size_t len;
+	int err = 0;
+
+	snprintf(gz, sizeof(gz), "%s.gz", path);
+
+	in = fopen(path, "r");
+	if (in == NULL)
+		return -errno;
+
+	out = gzopen(gz, "wb");
+	buff = malloc(64 * 1024);
+	if (out == NULL || buff == NULL) {
+		err = -ENOMEM;
+		goto exit;
+	}
+
+	while ((len = fread(buff, 1, 64 * 1024, in)) > 0) {
+		if (gzwrite(out, buff, len) != (int)len) {
+			err = -EIO;
+			break;
+		}
+	}
+	if (ferror(in))
+		err = -EIO;
+
+exit:
+	if (out != NULL && gzclose(out) != Z_OK && err == 0)
+		err = -EIO;
+	free(buff);
+	fclose(in);
+
+	if (err < 0)
+		unlink(gz);
+	else
+		unlink(path);
+
+	return err;
+}
+
+static void *log_compressor(void *priv)
+{
+	struct log *log = priv;
+	struct log_gz *gz;
+	int err;
+
+	pthread_mutex_lock(&log->gz.lock);
+	for (;;) {
+		while (log->gz.head == NULL && !log->gz.stop)
+			pthread_cond_wait(&log->gz.cond, &log->gz.lock);
+		gz = log->gz.head;
+		if (gz == NULL)
+			break;
+		log->gz.head = gz->next;
+		if (log->gz.head == NULL)
+			log->gz.tail = &log->gz.head;
+		pthread_mutex_unlock(&log->gz.lock);
+
+		err = log_gzip(gz->path);
+		if (err < 0)
+			syslog(LOG_WARNING, "%s: Can't compress: %s",
+			       gz->path, strerror(-err));
+		free(gz);
+
+		pthread_mutex_lock(&log->gz.lock);
+	}
+	pthread_mutex_unlock(&log->gz.lock);
+
+	return NULL;
+}
+#endif
+
+/* Queue a closed segment for the compressor, if there is one
+ */
+static void log_compress(struct log *log, const char *path)
+{
+	struct log_gz *gz;
+
+	if (!log->gz.running)
+		return;
+
+	gz = malloc(sizeof(*gz) + strlen(path) + 1);
+	if (gz == NULL)
+		return;
+	gz->next = NULL;
+	strcpy(gz->path, path);
+
+	pthread_mutex_lock(&log->gz.lock);
+	*log->gz.tail = gz;
+	log->gz.tail = &gz->next;
+	pthread_cond_signal(&log->gz.cond);
+	pthread_mutex_unlock(&log->gz.lock);
+}
+
+/* Rename a closed segment after its time range, so that
+ * log.vcd becomes log.20261017T120000Z-20261017T125959Z.vcd
+ */
+static void log_segment_done(struct log *log, const char *path,
+                             uint64_t start, uint64_t end, int compress)
+{
+	char name[PATH_MAX], gz[PATH_MAX + 3], from[20], to[20];
+	const char *ext, *base;
+	time_t secs;
+	struct tm tm;
+	int n = 0;
+
+	secs = start / 1000000000;
+	strftime(from, sizeof(from), "%Y%m%dT%H%M%SZ", gmtime_r(&secs, &tm));
+	secs = end / 1000000000;
+	strftime(to, sizeof(to), "%Y%m%dT%H%M%SZ", gmtime_r(&secs, &tm));
+
+	base = strrchr(path, '/');
+	base = (base == NULL) ? path : base + 1;
+	ext = strrchr(base, '.');
+	if (ext == NULL || ext == base)
+		ext = base + strlen(base);
+
+	/* Segments within the same second get a sequence number */
+	snprintf(name, sizeof(name), "%.*s.%s-%s%s",
+	         (int)(ext - path), path, from, to, ext);
+	for (;;) {
+		snprintf(gz, sizeof(gz), "%s.gz", name);
+		if (access(name, F_OK) < 0 && access(gz, F_OK) < 0)
+			break;
+		snprintf(name, sizeof(name), "%.*s.%s-%s.%d%s",
+		         (int)(ext - path), path, from, to, ++n, ext);
+	}
+	if (rename(path, name) < 0) {
+		syslog(LOG_WARNING, "%s: Can't rotate: %m", path);
+		return;
+	}
+
+	if (compress)
+		log_compress(log, name);
+}
+
+/* Set where the current segment began, and when it ends
+ */
+static void log_segment_begin(struct log *log, uint64_t time)
+{
+	uint64_t period = log->rotate.secs * 1000000000ULL;
+
+	log->rotate.start = time;
+	log->rotate.last = time;
+	log->rotate.until = period ? (time / period + 1) * period : 0;
+}
+
+static int log_rotate_due(struct log *log, uint64_t time)
+{
+	if (log->rotate.until != 0 && time >= log->rotate.until)
+		return 1;
+
+	if (log->rotate.size != 0 && log->file != NULL &&
+	    ftell(log->file) >= (long)log->rotate.size)
+		return 1;
+
+	return 0;
+}
+
+/* Close the current segments, and start new ones at 'time'
+ * that have every wire's value as of then.
+ */
+static void log_segment_next(struct log *log, uint64_t time)
+{
+	int i;
+
+	if (log->file != NULL) {
+		fclose(log->file);
+		log_segment_done(log, log->path, log->rotate.start, log->rotate.last, 1);
+		log->file = fopen(log->path, "w");
+		if (log->file == NULL) {
+			syslog(LOG_WARNING, "%s: Can't open: %m", log->path);
+		} else {
+			setvbuf(log->file, NULL, _IOFBF, 64 * 1024);
+			log_header(log, time);
+			log_time(log->file, time);
+		}
+	}
+
+	if (log->bin != NULL) {
+		aq_binlog_destroy(log->bin);
+		log_segment_done(log, log->bin_path, log->rotate.start, log->rotate.last, 0);
+		log->bin = aq_binlog_create(log->bin_path);
+		if (log->bin == NULL) {
+			syslog(LOG_WARNING, "%s: Can't open: %m", log->bin_path);
+		} else {
+			for (i = 1; i < log->wire_id; i++)
+				aq_binlog_wire(log->bin, i, log->wires[i].name);
+			aq_binlog_begin(log->bin);
+			for (i = 1; i < log->wire_id; i++) {
+				if (log->wires[i].valid)
+					aq_binlog_append(log->bin, i, time / 1000, log->wires[i].value);
+			}
+		}
+	}
+
+	log_segment_begin(log, time);
+}
+
+/* Format everything in the ring, and write it in one go
+ */
+static void log_drain(struct log *log, uint64_t *time)
+{
+	unsigned int head, tail;
+	struct log_rec *rec;
+
+	head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+	for (tail = log->tail; tail != head; tail++) {
+		rec = &log->ring[tail & (LOG_RING_SIZE - 1)];
+		if (rec->time != *time) {
+			*time = rec->time;
+			if (log_rotate_due(log, rec->time))
+				log_segment_next(log, rec->time);
+			else if (log->file != NULL)
+				log_time(log->file, rec->time);
+		}
+		log->rotate.last = rec->time;
+		log->wires[rec->wire].valid = 1;
+		log->wires[rec->wire].value = rec->value;
+
+		if (log->bin != NULL)
+			aq_binlog_append(log->bin, rec->wire, rec->time / 1000, rec->value);
+		if (log->file == NULL)
+			continue;
+
+		if (rec->type == LOG_REC_REAL)
+			fprintf(log->file, "r%.16g %X\n", (double)rec->value, rec->wire);
+		else
+			fprintf(log->file, "b%d %X\n", rec->value ? 1 : 0, rec->wire);
+	}
+	__atomic_store_n(&log->tail, tail, __ATOMIC_RELEASE);
+
+	if (log->file != NULL)
+		fflush(log->file);
+	if (log->bin != NULL)
+		aq_binlog_flush(log->bin);
+}
+
+static void *log_writer(void *priv)
+{
+	struct log *log = priv;
+	uint64_t time = 0, count;
+	unsigned int dropped, reported = 0;
+
+	while (!__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+		if (read(log->wake, &count, sizeof(count)) < 0 && errno != EINTR)
+			break;
+
+		log_drain(log, &time);
+
+		dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+		if (dropped != reported) {
+			syslog(LOG_WARNING, "Log writer fell behind, %u records dropped",
+			       dropped - reported);
+			reported = dropped;
+		}
+	}
+
+	log_drain(log, &time);
+
+	return NULL;
+}
+
+/* Open/close the log (VCD format, unless path is NULL)
+ *
+ * The file is not truncated until the first entry, in case
+ * it is a segment left over from before a crash that
+ * log_rotate() wants to keep.
  */
 struct log *log_open(const char *path)
 {
 	struct log *log;
-	FILE *file;
+	FILE *file = NULL;
 	int err;
 
-	file = fopen(path, "w");
-	if (file == NULL)
-		return NULL;
+	if (path != NULL) {
+		file = fopen(path, "a+");
+		if (file == NULL)
+			return NULL;
+	}
 
 	log = calloc(1, sizeof(*log));
 	log->file = file;
+	log->path = path ? strdup(path) : NULL;
 	log->state = LOG_STATE_INIT;
 	log->wire_id = 1;
+	log->wake = -1;
+	log->gz.tail = &log->gz.head;
 	err = hcreate_r(256, &log->hash);
 	if (err == 0) {
-		fclose(file);
+		if (file != NULL)
+			fclose(file);
+		free(log->path);
 		free(log);
 		return NULL;
 	}
 
-	fprintf(file, "$version Aquaria Aquarium Controller $end\n");
-	fprintf(file, "$timescale 1 ns $end\n");
-	fprintf(file, "$scope module Aquaria $end\n");
+	log->ring = calloc(LOG_RING_SIZE, sizeof(*log->ring));
+	if (log->ring == NULL) {
+		hdestroy_r(&log->hash);
+		if (file != NULL)
+			fclose(file);
+		free(log->path);
+		free(log);
+		return NULL;
+	}
+
+	/* The writer batches its output */
+	if (file != NULL)
+		setvbuf(file, NULL, _IOFBF, 64 * 1024);
 
 	return log;
 }
 
+/* Time range of a binary log, from its samples
+ */
+static int log_binary_span(void *priv, uint64_t time, uint64_t value)
+{
+	uint64_t *span = priv;
+
+	if (time < span[0])
+		span[0] = time;
+	if (time > span[1])
+		span[1] = time;
+
+	return 0;
+}
+
+/* Also log to a binary log. Call before registering anything.
+ */
+int log_binary(struct log *log, const char *path)
+{
+	struct aq_binlog *old;
+	struct stat st;
+	uint64_t span[2] = { UINT64_MAX, 0 };
+	int i;
+
+	if (log->bin != NULL || log->wire_id != 1)
+		return -EBUSY;
+
+	/* Keep a segment left over from before a crash */
+	if ((log->rotate.size || log->rotate.secs) &&
+	    stat(path, &st) == 0 && st.st_size > 0) {
+		old = aq_binlog_open(path);
+		if (old != NULL) {
+			for (i = 0; i < aq_binlog_wires(old); i++)
+				aq_binlog_read(old, i, 0, UINT64_MAX, log_binary_span, span);
+			aq_binlog_close(old);
+		}
+		if (span[0] > span[1])
+			span[0] = span[1] = st.st_mtime * 1000000ULL;
+		log_segment_done(log, path, span[0] * 1000, span[1] * 1000, 0);
+	}
+
+	log->bin = aq_binlog_create(path);
+	if (log->bin == NULL)
+		return -errno;
+	log->bin_path = strdup(path);
+
+	return 0;
+}
+
+/* Rotate the logs once they reach 'size' bytes of VCD, or on
+ * every multiple of 'secs' since the epoch. Call before
+ * log_binary().
+ */
+int log_rotate(struct log *log, uint64_t size, unsigned int secs)
+{
+	if (log->bin != NULL || log->state != LOG_STATE_INIT)
+		return -EBUSY;
+
+	log->rotate.size = size;
+	log->rotate.secs = secs;
+
+	return 0;
+}
+
 void log_close(struct log *log)
 {
+	uint64_t one = 1;
+	int i;
+
+	if (log->wake >= 0) {
+		__atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+		while (write(log->wake, &one, sizeof(one)) < 0) {
+			if (errno == EINTR)
+				continue;
+			/* It would never wake up; read() is a cancellation point */
+			syslog(LOG_WARNING, "Can't stop log writer: %m");
+			pthread_cancel(log->writer);
+			break;
+		}
+		pthread_join(log->writer, NULL);
+		close(log->wake);
+	}
+
+	if (log->file != NULL) {
+		fclose(log->file);
+		if (log->state == LOG_STATE_ACTIVE && (log->rotate.size || log->rotate.secs))
+			log_segment_done(log, log->path, log->rotate.start, log->rotate.last, 1);
+	}
+	if (log->bin != NULL) {
+		aq_binlog_destroy(log->bin);
+		if (log->state == LOG_STATE_ACTIVE && (log->rotate.size || log->rotate.secs))
+			log_segment_done(log, log->bin_path, log->rotate.start, log->rotate.last, 0);
+	}
+
+	/* Let it finish what is queued */
+	if (log->gz.running) {
+		pthread_mutex_lock(&log->gz.lock);
+		log->gz.stop = 1;
+		pthread_cond_signal(&log->gz.cond);
+		pthread_mutex_unlock(&log->gz.lock);
+		pthread_join(log->gz.thread, NULL);
+	}
+
 	hdestroy_r(&log->hash);
-	fclose(log->file);
+	for (i = 1; i < log->wire_id; i++)
+		free(log->wires[i].name);
+	free(log->wires);
+	free(log->path);
+	free(log->bin_path);
+	free(log->ring);
 	free(log);
 }
 
+/* Get the statistics of the ring
+ */
+void log_stats(struct log *log, unsigned int *overflows, unsigned int *dropped)
+{
+	*overflows = log->overflows;
+	*dropped = log->dropped;
+}
+
+/* Add a wire to the logs, and return its number
+ */
+static int log_wire(struct log *log, const char *name, int type)
+{
+	struct log_wire *wires;
+	int wire = log->wire_id;
+
+	wires = realloc(log->wires, (wire + 1) * sizeof(*wires));
+	if (wires == NULL)
+		return -ENOMEM;
+	log->wires = wires;
+
+	memset(&wires[wire], 0, sizeof(wires[wire]));
+	wires[wire].name = strdup(name);
+	wires[wire].type = type;
+	if (log->bin != NULL && aq_binlog_wire(log->bin, wire, name) == -ENAMETOOLONG)
+		syslog(LOG_WARNING, "%s: Name too long for the binary log (> 255 characters)",
+		       name);
+
+	log->wire_id++;
+	return wire;
+}
+
 void *log_register_sensor(struct log *log, const char *name, enum aq_sensor_type type)
 {
 	ENTRY ent, *pent = NULL;
-	char buff[32];
+	char buff[PATH_MAX];
 	int err;
 
-	snprintf(buff, sizeof(buff), "%X", log->wire_id++);
-	ent.key = strdup(name);
-	ent.data = strdup(buff);
-
 	assert(log->state == LOG_STATE_INIT);
 
+	snprintf(buff, sizeof(buff), "Sensor.%s", name);
+	err = log_wire(log, buff, LOG_REC_REAL);
+	if (err < 0)
+		return NULL;
+
+	ent.key = strdup(name);
+	ent.data = (void *)(uintptr_t)err;
+
 	err = hsearch_r(ent, ENTER, &pent, &log->hash);
 	assert(err != 0);
 
-	fprintf(log->file, "$var real 64 %s Sensor.%s $end\n", buff, name);
-
 	return pent;
 }
 
 void *log_register_device(struct log *log, const char *name)
 {
 	ENTRY ent, *pent = NULL;
-	char buff[32];
+	char buff[PATH_MAX];
 	int err;
 
-	snprintf(buff, sizeof(buff), "%X", log->wire_id++);
-	ent.key = strdup(name);
-	ent.data = strdup(buff);
-
 	assert(log->state == LOG_STATE_INIT);
 
+	snprintf(buff, sizeof(buff), "Device.%s", name);
+	err = log_wire(log, buff, LOG_REC_BIT);
+	if (err < 0)
+		return NULL;
+
+	ent.key = strdup(name);
+	ent.data = (void *)(uintptr_t)err;
+
 	err = hsearch_r(ent, ENTER, &pent, &log->hash);
 	assert(err != 0);
 
-	fprintf(log->file, "$var wire 1 %s Device.%s $end\n", buff, name);
-
 	return pent;
 }
 
+/* Keep a VCD segment left over from before a crash, from
+ * its $date to when it was last written.
+ */
+static void log_salvage(struct log *log)
+{
+	char line[256];
+	struct stat st;
+	struct tm tm;
+	uint64_t start, end;
+	int i;
+
+	if (fstat(fileno(log->file), &st) < 0 || st.st_size == 0)
+		return;
+
+	end = st.st_mtime * 1000000000ULL;
+	start = end;
+
+	rewind(log->file);
+	for (i = 0; i < 4 && fgets(line, sizeof(line), log->file) != NULL; i++) {
+		memset(&tm, 0, sizeof(tm));
+		if (strncmp(line, "$date ", 6) == 0 &&
+		    strptime(line + 6, "%Y-%m-%dT%H:%M:%SZ", &tm) != NULL) {
+			start = timegm(&tm) * 1000000000ULL;
+			break;
+		}
+	}
+
+	fclose(log->file);
+	log_segment_done(log, log->path, start, end, 1);
+
+	log->file = fopen(log->path, "w");
+	if (log->file == NULL) {
+		syslog(LOG_WARNING, "%s: Can't open: %m", log->path);
+		return;
+	}
+	setvbuf(log->file, NULL, _IOFBF, 64 * 1024);
+}
+
 /* Mark the start of a log entry
  */
 int log_start(struct log *log, struct timeval *tv)
 {
+	log->time = tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+
 	if (log->state == LOG_STATE_INIT) {
+		sigset_t all, old;
+		int rotate = (log->rotate.size || log->rotate.secs);
+
 		log->state = LOG_STATE_ACTIVE;
-		fprintf(log->file, "$upscope $end\n");
-		fprintf(log->file, "$enddefinitions $end\n");
+
+		/* The threads leave signals to the caller's thread */
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &old);
+
+#ifdef HAVE_LIBZ
+		if (rotate && log->file != NULL) {
+			pthread_mutex_init(&log->gz.lock, NULL);
+			pthread_cond_init(&log->gz.cond, NULL);
+			log->gz.running = (pthread_create(&log->gz.thread, NULL,
+			                                  log_compressor, log) == 0);
+		}
+#endif
+
+		if (log->file != NULL) {
+			if (rotate)
+				log_salvage(log);
+			else if (ftruncate(fileno(log->file), 0) < 0)
+				syslog(LOG_WARNING, "%s: Can't truncate: %m",
+				       log->path);
+		}
+		log_segment_begin(log, log->time);
+
+		if (log->file != NULL) {
+			log_header(log, log->time);
+			fflush(log->file);
+		}
+		if (log->bin != NULL)
+			aq_binlog_begin(log->bin);
+
+		/* From here on, only the writer touches the files */
+		log->wake = eventfd(0, EFD_CLOEXEC);
+		if (log->wake >= 0) {
+			if (pthread_create(&log->writer, NULL, log_writer, log) != 0) {
+				close(log->wake);
+				log->wake = -1;
+			}
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 	}
 
-	fprintf(log->file, "#%u%06u\n", (unsigned int)tv->tv_sec, (unsigned int)tv->tv_usec * 1000);
 	return 0;
 }
 
-/* Mark a sensor reading
+/* Queue a record for the writer, or count it as lost
  */
-int log_sensor(struct log *log, void *id, uint64_t reading)
+static int log_queue(struct log *log, ENTRY *ent, int type, uint64_t value)
 {
-	ENTRY *ent = id;
+	struct log_rec *rec;
+	unsigned int tail;
+
+	tail = __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE);
+	if (log->head - tail == LOG_RING_SIZE) {
+		if (!log->full)
+			log->overflows++;
+		log->full = 1;
+		__atomic_store_n(&log->dropped, log->dropped + 1, __ATOMIC_RELAXED);
+		return -ENOBUFS;
+	}
+	log->full = 0;
+
+	rec = &log->ring[log->head & (LOG_RING_SIZE - 1)];
+	rec->time = log->time;
+	rec->value = value;
+	rec->wire = (uintptr_t)ent->data;
+	rec->type = type;
+	__atomic_store_n(&log->head, log->head + 1, __ATOMIC_RELEASE);
 
-	fprintf(log->file, "r%.16g %s\n", (double)reading, (const char *)ent->data);
 	return 0;
 }
 
+/* Mark a sensor reading
+ */
+int log_sensor(struct log *log, void *id, uint64_t reading)
+{
+	return log_queue(log, id, LOG_REC_REAL, reading);
+}
+
 /* Mark a device state change
  */
 int log_device(struct log *log, void *id, int is_on)
 {
-	ENTRY *ent = id;
-
-	fprintf(log->file, "b%d %s\n", is_on ? 1 : 0, (const char *)ent->data);
-	return 0;
+	return log_queue(log, id, LOG_REC_BIT, is_on);
 }
 
-/* End the log entry
+/* End the log entry, and wake the writer
  */
 int log_pause(struct log *log)
 {
-	fflush(log->file);
+	uint64_t one = 1;
+
+	if (log->wake < 0) {
+		/* No writer thread; write it here */
+		uint64_t time = 0;
+
+		log_drain(log, &time);
+		return 0;
+	}
+
+	if (write(log->wake, &one, sizeof(one)) < 0)
+		return -errno;
+
 	return 0;
 }
@@ -32,6 +32,22 @@ struct log;
 struct log *log_open(const char *path);
 void log_close(struct log *log);
 
+/* Also log to a binary log (see aq_binlog.h)
+ */
+int log_binary(struct log *log, const char *path);
+
+/* Start a new log file every 'size' bytes of VCD and/or every
+ * 'secs' seconds (0 for no limit), renaming the old one after
+ * its time range. Call before log_binary().
+ */
+int log_rotate(struct log *log, uint64_t size, unsigned int secs);
+
+/* Records lost because the writer thread fell behind
+ *  overflows - times the ring filled up
+ *  dropped   - records lost while it was full
+ */
+void log_stats(struct log *log, unsigned int *overflows, unsigned int *dropped);
+
 void *log_register_sensor(struct log *log, const char *name, enum aq_sensor_type type);
 void *log_register_device(struct log *log, const char *name);
 
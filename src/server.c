@@ -21,8 +21,9 @@
 #include <signal.h>
 #include <inttypes.h>
 
-#include <sys/poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -30,6 +31,22 @@
 #include "aquaria.h"
 #include "aq_server.h"
 
+/* Most events handled per epoll_wait() */
+#define SERVER_EVENTS	64
+
+/* epoll data.ptr tags for the daemon's own descriptors.
+ * Anything else is a struct aq_server_conn.
+ */
+static char ev_listen, ev_listen_unix, ev_listen_http, ev_sched, ev_timer;
+
+/* Set by SIGINT or SIGTERM */
+static volatile sig_atomic_t server_quit;
+
+static void server_stop(int sig)
+{
+	server_quit = 1;
+}
+
 static void log_exit_reason(int exit_code, void *priv)
 {
 	if (exit_code != 0) {
@@ -39,6 +56,56 @@ static void log_exit_reason(int exit_code, void *priv)
 	}
 }
 
+/* Arm the schedule timer (wall clock) and the
+ * sensor sampling timer (monotonic clock).
+ */
+static void sched_timers(struct aquaria *aq, int wall_fd, int sample_fd)
+{
+	struct itimerspec wall = {}, sample = {};
+
+	aq_sched_next(aq, &wall.it_value, &sample.it_value);
+
+	/* Cancelled if the wall clock is set, so that we can re-arm */
+	timerfd_settime(wall_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &wall, NULL);
+	timerfd_settime(sample_fd, TFD_TIMER_ABSTIME, &sample, NULL);
+}
+
+static void sched_timer_clear(int fd)
+{
+	uint64_t expirations;
+	int err;
+
+	/* Either the count of expirations, ECANCELED,
+	 * or EAGAIN if this timer did not fire.
+	 */
+	err = read(fd, &expirations, sizeof(expirations));
+	(void)err;
+}
+
+static void server_watch(int epfd, int fd, uint32_t events, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = ptr;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		syslog(LOG_ERR, "Can't watch fd %d: %m", fd);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Edge-triggered, so accept all of them */
+static void server_accept(struct aquaria *aq, int epfd, int sock,
+                          struct aq_server_conn *(*connect)(struct aquaria *aq, int sock))
+{
+	struct aq_server_conn *conn;
+
+	while ((conn = connect(aq, sock)) != NULL) {
+		server_watch(epfd, aq_server_socket(conn),
+		             EPOLLIN | EPOLLOUT | EPOLLET, conn);
+	}
+}
+
 static void usage(const char *program)
 {
 	fprintf(stderr, "Usage:\n"
@@ -47,8 +114,21 @@ static void usage(const char *program)
 			"Options:\n"
 			"  -d DIR, --datadir DIR       location of Aquaria data\n"
 			"  -v FILE, --vcdlog FILE      VCD log (for use with gtkwave)\n"
+			"  -b FILE, --binlog FILE      binary log (see aq_binlog_open())\n"
+			"  -r SIZE, --rotate-size SIZE start new logs every SIZE bytes\n"
+			"                              of VCD (suffix K, M or G)\n"
+			"  -R TIME, --rotate-time TIME start new logs every TIME seconds\n"
+			"                              (suffix m, h or d)\n"
+			"  -a FILE, --rollup FILE      keep per-second, minute and hour\n"
+			"                              rollups of the readings\n"
 			"  -p PORT, --port NUM         port to listen at\n"
+			"  -H PORT, --http NUM         port to serve HTTP at (default none)\n"
+			"  -u PATH, --unix PATH        UNIX socket to listen at (default\n"
+			"                              " AQ_SOCKET_DEFAULT ", or \"\" for none)\n"
 			"  -n, --noop                  don't change any devices\n"
+			"  -D MS, --deadline MS        time to wait for sensor readings\n"
+			"  -s NAME, --shm NAME         shared memory state (default " AQ_SHM_DEFAULT ",\n"
+			"                              or \"\" for none)\n"
 			"\n"
 			"Commands:\n"
 			"  -h, -?, --help              this help message\n"
@@ -71,39 +151,114 @@ int main(int argc, char **argv)
 {
 	struct aquaria *aq;
 	int err;
-	int sock;
-	struct pollfd *fd;
-	struct aq_server_conn **conn;
-	int fds, i;
-	time_t last_time;
+	int sock, unix_sock = -1, http_sock = -1, epfd, wall_fd, sample_fd;
+	struct epoll_event ev[SERVER_EVENTS];
+	struct aq_server_conn *conn;
+	int i;
+	struct sigaction sa;
 	int port = 4444;	// Default aquaria port
+	int http_port = 0;
 	int c, option, noop = 0;
+	int deadline = -1;
+	int rearm = 1;
+	unsigned int armed = 0;
+	unsigned int overflows, dropped;
 	char *cp;
 	const char *datadir = "/etc/aquaria";
-	const char *vcdlog = "/dev/null";
+	const char *vcdlog = NULL;
+	const char *binlog = NULL;
+	const char *rollup = NULL;
+	uint64_t rotate_size = 0;
+	unsigned long rotate_time = 0;
+	const char *shm = AQ_SHM_DEFAULT;
+	const char *unix_path = AQ_SOCKET_DEFAULT;
 	struct option options[] = {
 		{ .name = "datadir", .has_arg = 1, .flag = NULL, .val = 'd' },
 		{ .name = "vcdlog", .has_arg = 1, .flag = NULL, .val = 'v' },
+		{ .name = "binlog", .has_arg = 1, .flag = NULL, .val = 'b' },
+		{ .name = "rotate-size", .has_arg = 1, .flag = NULL, .val = 'r' },
+		{ .name = "rotate-time", .has_arg = 1, .flag = NULL, .val = 'R' },
+		{ .name = "rollup", .has_arg = 1, .flag = NULL, .val = 'a' },
 		{ .name = "help", .has_arg = 0, .flag = NULL, .val = 'h' },
 		{ .name = "version", .has_arg = 0, .flag = NULL, .val = 'V' },
 		{ .name = "port", .has_arg = 1, .flag = NULL, .val = 'p' },
+		{ .name = "http", .has_arg = 1, .flag = NULL, .val = 'H' },
 		{ .name = "noop", .has_arg = 0, .flag = NULL, .val = 'n' },
+		{ .name = "deadline", .has_arg = 1, .flag = NULL, .val = 'D' },
+		{ .name = "shm", .has_arg = 1, .flag = NULL, .val = 's' },
+		{ .name = "unix", .has_arg = 1, .flag = NULL, .val = 'u' },
 		{ .name = NULL },
 	};
 
-	while ((c = getopt_long(argc, argv, "+d:hnpvV", options, &option)) >= 0) {
+	while ((c = getopt_long(argc, argv, "+a:b:d:D:hH:np:r:R:s:u:v:V", options, &option)) >= 0) {
 		switch (c) {
+		case 'a':
+			rollup = optarg;
+			break;
+		case 'b':
+			binlog = optarg;
+			break;
 		case 'd':
 			datadir = optarg;
 			break;
 		case 'n':
 			noop = 1;
 			break;
+		case 'D':
+			deadline = strtol(optarg, &cp, 0);
+			if (deadline < 0 || *cp != 0)
+				usage(argv[0]);
+			break;
 		case 'p':
 			port = strtol(optarg, &cp, 0);
 			if (port < 0 || *cp != 0)
 				usage(argv[0]);
 			break;
+		case 'r':
+			rotate_size = strtoull(optarg, &cp, 0);
+			switch (*cp) {
+			case 'G':
+				rotate_size <<= 10;
+				/* fall through */
+			case 'M':
+				rotate_size <<= 10;
+				/* fall through */
+			case 'K':
+				rotate_size <<= 10;
+				cp++;
+				break;
+			}
+			if (*cp != 0)
+				usage(argv[0]);
+			break;
+		case 'R':
+			rotate_time = strtoul(optarg, &cp, 0);
+			switch (*cp) {
+			case 'd':
+				rotate_time *= 24;
+				/* fall through */
+			case 'h':
+				rotate_time *= 60;
+				/* fall through */
+			case 'm':
+				rotate_time *= 60;
+				cp++;
+				break;
+			}
+			if (*cp != 0 || rotate_time > UINT_MAX)
+				usage(argv[0]);
+			break;
+		case 'H':
+			http_port = strtol(optarg, &cp, 0);
+			if (http_port < 0 || *cp != 0)
+				usage(argv[0]);
+			break;
+		case 's':
+			shm = optarg;
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
 		case 'v':
 			vcdlog = optarg;
 			break;
@@ -123,76 +278,168 @@ int main(int argc, char **argv)
 	/* Ignore SIGPIPE errors */
 	signal(SIGPIPE, SIG_IGN);
 
+	/* Stop cleanly, so that the logs are complete. Without
+	 * SA_RESTART, so that epoll_wait() returns.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = server_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
 	err = chdir(datadir);
 	if (err < 0) {
 		exit(EXIT_FAILURE);
 	}
 	aq = aq_create(vcdlog, noop);
+	if (aq == NULL) {
+		perror(vcdlog ? vcdlog : argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (rotate_size != 0 || rotate_time != 0) {
+		err = aq_log_rotate(aq, rotate_size, rotate_time);
+		if (err < 0) {
+			errno = -err;
+			perror(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (binlog != NULL) {
+		err = aq_log_binary(aq, binlog);
+		if (err < 0) {
+			errno = -err;
+			perror(binlog);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (deadline >= 0)
+		aq_sched_deadline(aq, deadline);
 	aq_config_read(aq, "config");
 	aq_sched_read(aq, "schedule");
 
+	if (rollup != NULL) {
+		err = aq_rollup_open(aq, rollup);
+		if (err < 0) {
+			errno = -err;
+			perror(rollup);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* Local readers can do without it, so carry on */
+	if (shm[0] != 0 && aq_shm_publish(aq, shm) < 0)
+		syslog(LOG_WARNING, "Can't publish state in %s: %m", shm);
+
 	sock = aq_server_open(port);
 	if (sock < 0) {
 		perror(argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	fd = calloc(1, sizeof(*fd));
-	fds = 1;
-	fd[0].fd = sock;
-	fd[0].events = POLLIN | POLLHUP | POLLNVAL;
-	fd[0].revents = 0;
-
-	/* Placeholder for the inbound socket
-	 * This keeps us from having to do off-by-one
-	 * math everywhere.
-	 */
-	conn = malloc(sizeof(*conn));
-	conn[0] = NULL;
 
-	last_time = time(NULL);
-	aq_sched_eval(aq);
+	/* Local clients can still use the port */
+	if (unix_path[0] != 0) {
+		unix_sock = aq_server_open_unix(unix_path);
+		if (unix_sock < 0)
+			syslog(LOG_WARNING, "Can't listen at %s: %m", unix_path);
+	}
 
-	while (1) {
-		err = poll(fd, fds, 1000);
-		if (err == 0 || time(NULL) != last_time) {
-			aq_sched_eval(aq);
-			last_time = time(NULL);
+	if (http_port != 0) {
+		http_sock = aq_server_open(http_port);
+		if (http_sock < 0) {
+			perror(argv[0]);
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	wall_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	sample_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epfd < 0 || wall_fd < 0 || sample_fd < 0) {
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	server_watch(epfd, sock, EPOLLIN | EPOLLET, &ev_listen);
+	if (unix_sock >= 0)
+		server_watch(epfd, unix_sock, EPOLLIN | EPOLLET, &ev_listen_unix);
+	if (http_sock >= 0)
+		server_watch(epfd, http_sock, EPOLLIN | EPOLLET, &ev_listen_http);
+	server_watch(epfd, aq_sched_fd(aq), EPOLLIN, &ev_sched);
+	server_watch(epfd, wall_fd, EPOLLIN, &ev_timer);
+	server_watch(epfd, sample_fd, EPOLLIN, &ev_timer);
 
-		if (fd[0].revents & POLLIN) {
-			conn = realloc(conn, sizeof(conn[0]) * (fds + 1));
-			conn[fds] = aq_server_connect(aq, fd[0].fd);
-			fd = realloc(fd, sizeof(fd[0]) * (fds + 1));
-			fd[fds].fd = aq_server_socket(conn[fds]);
-			fd[fds].events = POLLIN | POLLHUP | POLLNVAL;
-			fd[fds].revents = 0;
-			fds++;
-			fd[0].revents = 0;
+	aq_sched_eval(aq);
+
+	while (!server_quit) {
+		int events, timer = 0, evaluated = 0;
+
+		/* Only the schedule's own events, and changes to the
+		 * state (such as a client's override), can move the
+		 * timers. Client requests otherwise leave them be.
+		 */
+		if (rearm || aq_generation(aq) != armed) {
+			sched_timers(aq, wall_fd, sample_fd);
+			armed = aq_generation(aq);
+			rearm = 0;
 		}
 
-		for (i = 1; i < fds; i++) {
-			if (fd[i].revents & POLLIN) {
-				err = aq_server_handle(conn[i]);
-				if (err < 0)
-					fd[i].revents |= POLLHUP;
-				fd[i].revents &= ~POLLIN;
-			}
-			if (fd[i].revents) {
-				/* Socket died. */
-				aq_server_disconnect(conn[i]);
-				close(fd[i].fd);
-				memmove(&conn[i], &conn[i+1], sizeof(*conn) * (fds - i - 1));
-				memmove(&fd[i], &fd[i+1], sizeof(*fd) * (fds - i - 1));
-				fds--;
+		events = epoll_wait(epfd, ev, SERVER_EVENTS, -1);
+		if (events < 0)
+			continue;
+
+		for (i = 0; i < events; i++) {
+			if (ev[i].data.ptr == &ev_timer) {
+				timer = 1;
+			} else if (ev[i].data.ptr == &ev_sched) {
+				evaluated |= aq_sched_handle(aq);
+				rearm = 1;
+			} else if (ev[i].data.ptr == &ev_listen) {
+				server_accept(aq, epfd, sock, aq_server_connect);
+			} else if (ev[i].data.ptr == &ev_listen_unix) {
+				server_accept(aq, epfd, unix_sock, aq_server_connect);
+			} else if (ev[i].data.ptr == &ev_listen_http) {
+				server_accept(aq, epfd, http_sock, aq_server_connect_http);
+			} else {
+				conn = ev[i].data.ptr;
+				err = 0;
+				if (ev[i].events & EPOLLIN)
+					err = aq_server_handle(conn);
+				if (err >= 0 && (ev[i].events & EPOLLOUT))
+					err = aq_server_flush(conn);
+				if (err < 0 || (ev[i].events & (EPOLLHUP | EPOLLERR))) {
+					/* Socket died. Closing it removes it from epfd. */
+					aq_server_disconnect(conn);
+				}
 			}
 		}
+
+		if (timer) {
+			sched_timer_clear(wall_fd);
+			sched_timer_clear(sample_fd);
+			evaluated |= aq_sched_eval(aq);
+			rearm = 1;
+		}
+
+		if (evaluated)
+			aq_server_notify(aq);
 	}
 
-	for (i = 0; i < fds; i ++) {
-		close(fd[i].fd);
+	close(sample_fd);
+	close(wall_fd);
+	close(epfd);
+	if (unix_sock >= 0) {
+		close(unix_sock);
+		unlink(unix_path);
 	}
+	if (http_sock >= 0)
+		close(http_sock);
+	close(sock);
+
+	aq_log_stats(aq, &overflows, &dropped);
+	if (overflows > 0)
+		syslog(LOG_WARNING, "Log ring filled %u times, %u records dropped",
+		       overflows, dropped);
 
-	free(fd);
+	aq_free(aq);
 
 	return EXIT_SUCCESS;
 }
@@ -20,7 +20,8 @@
 #
 #  Primitive CGI proxy for Aquaria JSON requests
 #
-# Requires netcat
+# Requires netcat. The daemon can serve these itself, without
+# a process per request; see 'aquaria --http'.
 
 echo "Content-type: application/json"
 echo
@@ -26,6 +26,7 @@
 #include <assert.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -279,7 +280,7 @@ void handle_key(char menu_path[PATH_MAX], aq_key key)
 		node = menu_mkpath(&top_node, menu_path);
 		if (node->type == NODE_DEVICE) {
 			enum aq_state is_on = aq_device_get(node->sub.device, NULL);
-			aq_device_set(node->sub.device, (is_on == AQ_STATE_ON) ? AQ_STATE_OFF : AQ_STATE_ON, NULL);
+			aq_device_set_start(node->sub.device, (is_on == AQ_STATE_ON) ? AQ_STATE_OFF : AQ_STATE_ON, NULL, NULL, NULL);
 		}
 		break;
 	case AQ_KEY_CANCEL:
@@ -287,7 +288,7 @@ void handle_key(char menu_path[PATH_MAX], aq_key key)
 		if (node->type == NODE_DEVICE) {
 			time_t done = 0;
 			int is_on = aq_device_get(node->sub.device, NULL);
-			aq_device_set(node->sub.device, is_on, &done);
+			aq_device_set_start(node->sub.device, is_on, &done, NULL, NULL);
 		}
 		break;
 	default:
@@ -297,15 +298,33 @@ void handle_key(char menu_path[PATH_MAX], aq_key key)
 	return;
 }
 
+static void ui_subscribed(struct aquaria *aq, int err, void *priv)
+{
+	int *subscribed = priv;
+
+	/* Subscribe again on the next pass if it ended */
+	*subscribed = (err == 0);
+}
+
 int ui_mainloop(struct aquaria *aq, void *ui)
 {
 	char menu_path[PATH_MAX] = {};
+	int subscribed = 0;
 
 	while (1) {
 		aq_key key;
 
+		/* The daemon pushes its changes, so nothing here
+		 * waits on it, and the keypad is never held up.
+		 */
+		if (!subscribed) {
+			subscribed = 1;
+			if (aq_subscribe_start(aq, ui_subscribed, &subscribed) < 0)
+				subscribed = 0;
+		}
+
 		key = ui_keywait(ui, 1000);	/* Wait up to 1 second */
-		aq_sync(aq, NULL, NULL);
+		aq_process(aq);
 		if (key == AQ_KEY_QUIT)
 			return 0;
 		else if (key == AQ_KEY_ERROR)
@@ -318,10 +337,28 @@ int ui_mainloop(struct aquaria *aq, void *ui)
 	}
 }
 
+static struct aquaria *ui_connect(const struct sockaddr *sa, socklen_t len)
+{
+	struct aquaria *aq;
+
+	aq = aq_connect_async(sa, len);
+	if (aq == NULL)
+		return NULL;
+
+	aq_binary(aq);
+	if (aq_sync(aq, NULL, NULL) < 0) {
+		aq_free(aq);
+		return NULL;
+	}
+
+	return aq;
+}
+
 int main(int argc, char **argv)
 {
 	int err;
 	struct aquaria *aq;
+	struct sockaddr_un sun = { .sun_family = AF_UNIX, .sun_path = AQ_SOCKET_DEFAULT };
 	struct sockaddr_in sin;
 	void *ui;
 
@@ -329,7 +366,14 @@ int main(int argc, char **argv)
 	sin.sin_port = htons(4444);
 	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 
-	aq = aq_connect((const struct sockaddr *)&sin, sizeof(sin));
+	/* Skip the TCP/IP stack when the daemon is local */
+	aq = ui_connect((const struct sockaddr *)&sun, sizeof(sun));
+	if (aq == NULL)
+		aq = ui_connect((const struct sockaddr *)&sin, sizeof(sin));
+	if (aq == NULL) {
+		fprintf(stderr, "%s: Can't reach the aquaria daemon\n", argv[0]);
+		return EXIT_FAILURE;
+	}
 	menu_setup(aq);
 
 	ui = ui_open(argc, argv);